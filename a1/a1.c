@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -6,8 +7,26 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define MAGIC_VALUE "Nn1J"
+#define MAX_THREADS 64
+#define HEADER_FAST_SIZE 512
+#define DENTS_BUF_SIZE 65536
+#define OPEN_FILES_MAX 64
+#define SERVE_MAX_ARGS 64
+#define FILTER_MAX_STEPS 8
+#define URING_DEPTH 256
+#define URING_BATCH 32
+#define CACHE_MAGIC "SFHC"
+#define LINE_INDEX_MAGIC "SFLX"
 struct __attribute__((packed)) section_header{
     char sect_name[7];
     int sect_type;
@@ -23,265 +42,1763 @@ struct header{
     char magic[4];
 };
 
-void free_header(struct header *header) {
-    if (header && header->section_headers) {
-        free(header->section_headers);
-        header->section_headers = NULL;
+#define HEADER_TABLE_MAX (5 + 14 * (int)sizeof(struct section_header))
+
+static FILE *output = NULL;
+
+int parse_trailer(const char *buf, off_t n, off_t file_size, struct header *header){
+    memset(header, 0, sizeof(struct header));
+
+    memcpy(header->magic, buf + n - 4, 4);
+    if(strncmp(header->magic, MAGIC_VALUE, 4) != 0){
+        return header->version = -1;
+    }
+
+    memcpy(&header->header_size, buf + n - 6, 2);
+    if(header->header_size < 11 || header->header_size > file_size){
+        return header->version = -2;
+    }
+    return 0;
+}
+
+int parse_table(char *hdr, int avail, struct header *header){
+    int version;
+    memcpy(&version, hdr, 4);
+    if(version < 31 || version > 75){
+        return header->version = -2;
+    }
+
+    header->no_of_sections = (unsigned char)hdr[4];
+    if(header->no_of_sections != 2 && (header->no_of_sections < 8 || header->no_of_sections > 14)) {
+        return header->version = -3;
+    }
+    if(5 + header->no_of_sections * (int)sizeof(struct section_header) > avail){
+        return header->version = -3;
+    }
+
+    header->section_headers = (struct section_header*)(hdr + 5);
+    for(int i = 0; i < header->no_of_sections; i++) {
+        if(header->section_headers[i].sect_type != 90 && 
+           header->section_headers[i].sect_type != 13 && 
+           header->section_headers[i].sect_type != 82 && 
+           header->section_headers[i].sect_type != 39 && 
+           header->section_headers[i].sect_type != 81) {
+            header->section_headers = NULL;
+            return header->version = -4;
+        }
+    }
+
+    header->version = version;
+    return version;
+}
+
+int parse_fd(int fd, off_t file_size, char *buf, struct header *header){
+    memset(header, 0, sizeof(struct header));
+
+    if(file_size < 6){
+        return header->version = -1;
+    }
+
+    off_t n = file_size < HEADER_FAST_SIZE ? file_size : HEADER_FAST_SIZE;
+    if(pread(fd, buf, n, file_size - n) != n){
+        return header->version = -1;
+    }
+
+    if(parse_trailer(buf, n, file_size, header) < 0){
+        return header->version;
+    }
+
+    int avail = header->header_size - 6;
+    if(header->header_size > n){
+        avail = avail < HEADER_TABLE_MAX ? avail : HEADER_TABLE_MAX;
+        if(pread(fd, buf, avail, file_size - header->header_size) != avail){
+            return header->version = -2;
+        }
+        return parse_table(buf, avail, header);
+    }
+    return parse_table(buf + n - header->header_size, avail, header);
+}
+
+struct cache_entry{
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime;
+    long long size;
+    int version;
+    int no_of_sections;
+    struct section_header section_headers[14];
+};
+
+struct cache_file_header{
+    char magic[4];
+    int format;
+    unsigned int capacity;
+    unsigned int count;
+};
+
+struct header_cache{
+    char *path;
+    void *map;
+    size_t map_size;
+    struct cache_entry *entries;
+    unsigned int capacity;
+    struct cache_entry *added;
+    unsigned int added_count;
+    unsigned int added_capacity;
+    pthread_mutex_t lock;
+};
+
+static unsigned int cache_hash(unsigned long long dev, unsigned long long ino, unsigned int capacity){
+    unsigned long long h = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL);
+    h ^= h >> 29;
+    return (unsigned int)h & (capacity - 1);
+}
+
+static void cache_key(const struct stat *statBuf, struct cache_entry *entry){
+    entry->dev = statBuf->st_dev;
+    entry->ino = statBuf->st_ino;
+    entry->mtime = (long long)statBuf->st_mtim.tv_sec * 1000000000LL + statBuf->st_mtim.tv_nsec;
+    entry->size = statBuf->st_size;
+}
+
+static struct cache_entry* cache_find(struct cache_entry *entries, unsigned int capacity, unsigned long long dev, unsigned long long ino){
+    if(capacity == 0){
+        return NULL;
+    }
+    for(unsigned int i = cache_hash(dev, ino, capacity), probes = 0; probes < capacity; i = (i + 1) & (capacity - 1), probes++){
+        if(entries[i].version == 0 || (entries[i].dev == dev && entries[i].ino == ino)){
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+struct header_cache* cache_open(const char *path){
+    struct header_cache *cache = (struct header_cache*)calloc(1, sizeof(struct header_cache));
+    struct stat statBuf;
+
+    pthread_mutex_init(&cache->lock, NULL);
+    if(path == NULL){
+        return cache;
+    }
+    cache->path = strdup(path);
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        return cache;
+    }
+    if(fstat(fd, &statBuf) == 0 && statBuf.st_size >= (off_t)sizeof(struct cache_file_header)){
+        void *map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map != MAP_FAILED){
+            struct cache_file_header *fileHeader = (struct cache_file_header*)map;
+            if(memcmp(fileHeader->magic, CACHE_MAGIC, 4) == 0 && fileHeader->format == (int)sizeof(struct cache_entry) &&
+               fileHeader->capacity > 0 && (fileHeader->capacity & (fileHeader->capacity - 1)) == 0 &&
+               (off_t)(sizeof(struct cache_file_header) + (size_t)fileHeader->capacity * sizeof(struct cache_entry)) == statBuf.st_size){
+                cache->map = map;
+                cache->map_size = statBuf.st_size;
+                cache->entries = (struct cache_entry*)((char*)map + sizeof(struct cache_file_header));
+                cache->capacity = fileHeader->capacity;
+            } else {
+                munmap(map, statBuf.st_size);
+            }
+        }
+    }
+    close(fd);
+    return cache;
+}
+
+// Entries come from a file on disk, so they get the same checks parse_table()
+// applies before their section table is copied out.
+static int cache_entry_valid(const struct cache_entry *entry){
+    if(entry->version < 0){
+        return entry->version >= -4;
+    }
+    if(entry->version < 31 || entry->version > 75){
+        return 0;
+    }
+    if(entry->no_of_sections != 2 && (entry->no_of_sections < 8 || entry->no_of_sections > 14)){
+        return 0;
+    }
+    for(int i = 0; i < entry->no_of_sections; i++){
+        int type = entry->section_headers[i].sect_type;
+        if(type != 90 && type != 13 && type != 82 && type != 39 && type != 81){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int cache_fill(const struct cache_entry *entry, const struct cache_entry *key, char *buf, struct header *header){
+    if(entry == NULL || entry->version == 0 || entry->mtime != key->mtime || entry->size != key->size){
+        return 0;
+    }
+    if(!cache_entry_valid(entry)){
+        return 0;
+    }
+    memset(header, 0, sizeof(struct header));
+    header->version = entry->version;
+    if(entry->version > 0){
+        header->no_of_sections = entry->no_of_sections;
+        memcpy(buf, entry->section_headers, entry->no_of_sections * sizeof(struct section_header));
+        header->section_headers = (struct section_header*)buf;
+        memcpy(header->magic, MAGIC_VALUE, 4);
+    }
+    return 1;
+}
+
+int cache_lookup(struct header_cache *cache, const struct stat *statBuf, char *buf, struct header *header){
+    struct cache_entry key;
+    int hit = 0;
+
+    cache_key(statBuf, &key);
+    if(cache_fill(cache_find(cache->entries, cache->capacity, key.dev, key.ino), &key, buf, header)){
+        return 1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    hit = cache_fill(cache_find(cache->added, cache->added_capacity, key.dev, key.ino), &key, buf, header);
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+static void cache_insert(struct cache_entry *entries, unsigned int capacity, const struct cache_entry *entry){
+    struct cache_entry *slot = cache_find(entries, capacity, entry->dev, entry->ino);
+    if(slot != NULL){
+        *slot = *entry;
+    }
+}
+
+void cache_store(struct header_cache *cache, const struct stat *statBuf, const struct header *header){
+    struct cache_entry entry = {0};
+
+    if(header->version < -4 || header->version == 0){
+        return;
+    }
+    cache_key(statBuf, &entry);
+    entry.version = header->version;
+    if(header->version > 0){
+        entry.no_of_sections = header->no_of_sections;
+        memcpy(entry.section_headers, header->section_headers, header->no_of_sections * sizeof(struct section_header));
+    }
+    pthread_mutex_lock(&cache->lock);
+    if((cache->added_count + 1) * 2 > cache->added_capacity){
+        unsigned int capacity = cache->added_capacity ? cache->added_capacity * 2 : 256;
+        struct cache_entry *added = (struct cache_entry*)calloc(capacity, sizeof(struct cache_entry));
+        if(added == NULL){
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+        for(unsigned int i = 0; i < cache->added_capacity; i++){
+            if(cache->added[i].version != 0){
+                cache_insert(added, capacity, &cache->added[i]);
+            }
+        }
+        free(cache->added);
+        cache->added = added;
+        cache->added_capacity = capacity;
+    }
+    struct cache_entry *slot = cache_find(cache->added, cache->added_capacity, entry.dev, entry.ino);
+    cache->added_count += slot->version == 0;
+    *slot = entry;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int cache_save(struct header_cache *cache){
+    struct cache_file_header fileHeader = {{0}};
+    unsigned int count = cache->added_count;
+    unsigned int capacity = 64;
+    int ret = -1;
+
+    for(unsigned int i = 0; i < cache->capacity; i++){
+        count += cache->entries[i].version != 0;
+    }
+    while(capacity < count * 2){
+        capacity *= 2;
+    }
+
+    struct cache_entry *entries = (struct cache_entry*)calloc(capacity, sizeof(struct cache_entry));
+    if(entries == NULL){
+        return -1;
+    }
+    for(unsigned int i = 0; i < cache->capacity; i++){
+        if(cache->entries[i].version != 0){
+            cache_insert(entries, capacity, &cache->entries[i]);
+        }
+    }
+    for(unsigned int i = 0; i < cache->added_capacity; i++){
+        if(cache->added[i].version != 0){
+            cache_insert(entries, capacity, &cache->added[i]);
+        }
+    }
+    memcpy(fileHeader.magic, CACHE_MAGIC, 4);
+    fileHeader.format = sizeof(struct cache_entry);
+    fileHeader.capacity = capacity;
+    for(unsigned int i = 0; i < capacity; i++){
+        fileHeader.count += entries[i].version != 0;
+    }
+
+    size_t tmpLen = strlen(cache->path) + 5;
+    char *tmpPath = (char*)malloc(tmpLen);
+    snprintf(tmpPath, tmpLen, "%s.tmp", cache->path);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd != -1){
+        size_t size = (size_t)capacity * sizeof(struct cache_entry);
+        if(write(fd, &fileHeader, sizeof(fileHeader)) == sizeof(fileHeader) && write(fd, entries, size) == (ssize_t)size){
+            ret = 0;
+        }
+        close(fd);
+        if(ret == 0 && rename(tmpPath, cache->path) != 0){
+            ret = -1;
+        }
+        if(ret != 0){
+            unlink(tmpPath);
+        }
+    }
+    free(tmpPath);
+    free(entries);
+    return ret;
+}
+
+void cache_close(struct header_cache *cache){
+    if(cache == NULL){
+        return;
+    }
+    if(cache->added_count > 0 && cache->path != NULL){
+        cache_save(cache);
+    }
+    if(cache->map != NULL){
+        munmap(cache->map, cache->map_size);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->added);
+    free(cache->path);
+    free(cache);
+}
+
+struct header parse(const char* path, char *buf, struct header_cache *cache){
+    struct header header = {0};
+    struct stat statBuf;
+
+    if(cache != NULL){
+        if(stat(path, &statBuf) != 0){
+            header.version = -5;
+            return header;
+        }
+        if(cache_lookup(cache, &statBuf, buf, &header)){
+            return header;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1){
+        header.version = -5;
+        return header;
+    }
+
+    if(fstat(fd, &statBuf) != 0){
+        close(fd);
+        header.version = -5;
+        return header;
+    }
+
+    parse_fd(fd, statBuf.st_size, buf, &header);
+    close(fd);
+    if(cache != NULL){
+        cache_store(cache, &statBuf, &header);
+    }
+    return header;
+}
+
+void print_header(struct header header) {
+    fprintf(output, "SUCCESS\n");
+    fprintf(output, "version=%d\n", header.version);
+    fprintf(output, "nr_sections=%d\n", header.no_of_sections);
+
+    for(int i = 0; i < header.no_of_sections; i++) {
+        char name[8] = {0};
+        strncpy(name, header.section_headers[i].sect_name, 7);
+        fprintf(output, "section%d: %s %d %d\n", i + 1, name, header.section_headers[i].sect_type, header.section_headers[i].sect_size);
+    }
+}
+struct walk_worker;
+
+typedef void (*visit_fn)(struct walk_worker *worker, int dirfd, const char *name, const char *path, const struct stat *statBuf);
+typedef int (*name_fn)(void *arg, const char *name, size_t nameLen);
+typedef void (*finish_fn)(struct walk_worker *worker);
+
+struct dir_ref{
+    int fd;
+    int refs;
+};
+
+struct dir_task{
+    struct dir_ref *parent;
+    size_t name_off;
+    char path[];
+};
+
+struct task_deque{
+    pthread_mutex_t lock;
+    struct dir_task **tasks;
+    int head;
+    int tail;
+    int capacity;
+};
+
+struct walker{
+    int nthreads;
+    int rec;
+    int need_stat;
+    name_fn accept_name;
+    visit_fn visit;
+    finish_fn finish;
+    void *arg;
+    struct walk_worker *workers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    long pending;
+    long work_seq;
+    int idle;
+};
+
+struct walk_worker{
+    struct walker *walker;
+    struct task_deque deque;
+    int id;
+    char *path;
+    size_t path_cap;
+    char *dents;
+    struct dir_ref *dir;
+    void *ctx;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    pthread_t thread;
+};
+
+static void deque_push(struct task_deque *deque, struct dir_task *task){
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head == deque->tail){
+        deque->head = deque->tail = 0;
+    }
+    if(deque->tail == deque->capacity){
+        if(deque->head > 0){
+            memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(struct dir_task*));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->tasks = (struct dir_task**)realloc(deque->tasks, deque->capacity * sizeof(struct dir_task*));
+        }
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static struct dir_task* deque_pop(struct task_deque *deque){
+    struct dir_task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail > deque->head){
+        task = deque->tasks[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static struct dir_task* deque_steal(struct task_deque *deque){
+    struct dir_task *task = NULL;
+    if(pthread_mutex_trylock(&deque->lock) != 0){
+        return NULL;
+    }
+    if(deque->tail > deque->head){
+        task = deque->tasks[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void dir_ref_put(struct dir_ref *ref){
+    if(ref != NULL && __atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        close(ref->fd);
+        free(ref);
+    }
+}
+
+static void walk_flush(struct walk_worker *worker){
+    if(worker->out_len > 0){
+        fwrite(worker->out, 1, worker->out_len, output);
+        worker->out_len = 0;
+    }
+}
+
+static void walk_emit(struct walk_worker *worker, const char *line){
+    size_t len = strlen(line);
+    if(worker->out_len + len + 1 > worker->out_cap){
+        walk_flush(worker);
+        if(len + 1 > worker->out_cap){
+            worker->out_cap = len + 1 > 65536 ? len + 1 : 65536;
+            worker->out = (char*)realloc(worker->out, worker->out_cap);
+        }
+    }
+    memcpy(worker->out + worker->out_len, line, len);
+    worker->out[worker->out_len + len] = '\n';
+    worker->out_len += len + 1;
+}
+
+static void walk_push(struct walk_worker *worker, struct dir_task *task){
+    struct walker *walker = worker->walker;
+    __atomic_add_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST);
+    deque_push(&worker->deque, task);
+    __atomic_add_fetch(&walker->work_seq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&walker->idle, __ATOMIC_SEQ_CST) > 0){
+        pthread_mutex_lock(&walker->idle_lock);
+        pthread_cond_signal(&walker->idle_cond);
+        pthread_mutex_unlock(&walker->idle_lock);
+    }
+}
+
+static struct dir_task* dir_task_new(struct dir_ref *parent, const char *path, size_t name_off){
+    size_t len = strlen(path);
+    struct dir_task *task = (struct dir_task*)malloc(sizeof(struct dir_task) + len + 1);
+    task->parent = parent;
+    task->name_off = name_off;
+    memcpy(task->path, path, len + 1);
+    if(parent != NULL){
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static mode_t dtype_to_mode(unsigned char type){
+    switch(type){
+        case DT_DIR: return S_IFDIR;
+        case DT_REG: return S_IFREG;
+        case DT_LNK: return S_IFLNK;
+        case DT_FIFO: return S_IFIFO;
+        case DT_SOCK: return S_IFSOCK;
+        case DT_CHR: return S_IFCHR;
+        case DT_BLK: return S_IFBLK;
+    }
+    return 0;
+}
+
+static void walk_dir(struct walk_worker *worker, struct dir_task *task){
+    struct walker *walker = worker->walker;
+    struct stat statBuf;
+    size_t pathLen = strlen(task->path);
+    int dirfd = openat(task->parent ? task->parent->fd : AT_FDCWD, task->path + task->name_off, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    dir_ref_put(task->parent);
+    if(dirfd == -1){
+        return;
+    }
+    struct dir_ref *ref = (struct dir_ref*)malloc(sizeof(struct dir_ref));
+    ref->fd = dirfd;
+    ref->refs = 1;
+    worker->dir = ref;
+
+    for(;;){
+        ssize_t n = getdents64(dirfd, worker->dents, DENTS_BUF_SIZE);
+        if(n <= 0){
+            break;
+        }
+        for(ssize_t pos = 0; pos < n; ){
+            struct dirent64 *entry = (struct dirent64*)(worker->dents + pos);
+            pos += entry->d_reclen;
+            if(entry->d_name[0] == '.' && (entry->d_name[1] == 0 || (entry->d_name[1] == '.' && entry->d_name[2] == 0))){
+                continue;
+            }
+            size_t nameLen = strlen(entry->d_name);
+            int named = walker->accept_name == NULL || walker->accept_name(walker->arg, entry->d_name, nameLen);
+            if(!named && (!walker->rec || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN))){
+                continue;
+            }
+            if(pathLen + nameLen + 2 > worker->path_cap){
+                worker->path_cap = (pathLen + nameLen + 2) * 2;
+                worker->path = (char*)realloc(worker->path, worker->path_cap);
+            }
+            memcpy(worker->path, task->path, pathLen);
+            worker->path[pathLen] = '/';
+            memcpy(worker->path + pathLen + 1, entry->d_name, nameLen + 1);
+
+            if((named && walker->need_stat) || entry->d_type == DT_UNKNOWN){
+                if(fstatat(dirfd, entry->d_name, &statBuf, AT_SYMLINK_NOFOLLOW) != 0){
+                    continue;
+                }
+            } else {
+                memset(&statBuf, 0, sizeof(statBuf));
+                statBuf.st_mode = dtype_to_mode(entry->d_type);
+            }
+            if(named){
+                walker->visit(worker, dirfd, entry->d_name, worker->path, &statBuf);
+            }
+            if(walker->rec && S_ISDIR(statBuf.st_mode)){
+                walk_push(worker, dir_task_new(ref, worker->path, pathLen + 1));
+            }
+        }
+    }
+    worker->dir = NULL;
+    dir_ref_put(ref);
+}
+
+static struct dir_task* walk_next(struct walk_worker *worker){
+    struct walker *walker = worker->walker;
+    struct dir_task *task = deque_pop(&worker->deque);
+
+    while(task == NULL){
+        long seen = __atomic_load_n(&walker->work_seq, __ATOMIC_SEQ_CST);
+        for(int i = 1; i < walker->nthreads && task == NULL; i++){
+            task = deque_steal(&walker->workers[(worker->id + i) % walker->nthreads].deque);
+        }
+        if(task != NULL){
+            break;
+        }
+        pthread_mutex_lock(&walker->idle_lock);
+        __atomic_add_fetch(&walker->idle, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST) > 0 &&
+              __atomic_load_n(&walker->work_seq, __ATOMIC_SEQ_CST) == seen){
+            pthread_cond_wait(&walker->idle_cond, &walker->idle_lock);
+        }
+        __atomic_sub_fetch(&walker->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&walker->idle_lock);
+        if(__atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST) == 0){
+            return NULL;
+        }
+        task = deque_pop(&worker->deque);
+    }
+    return task;
+}
+
+static void* walk_worker_run(void *arg){
+    struct walk_worker *worker = (struct walk_worker*)arg;
+    struct walker *walker = worker->walker;
+    struct dir_task *task = NULL;
+
+    while((task = walk_next(worker)) != NULL){
+        walk_dir(worker, task);
+        free(task);
+        if(__atomic_sub_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST) == 0){
+            pthread_mutex_lock(&walker->idle_lock);
+            pthread_cond_broadcast(&walker->idle_cond);
+            pthread_mutex_unlock(&walker->idle_lock);
+        }
+    }
+    if(walker->finish != NULL){
+        walker->finish(worker);
+    }
+    walk_flush(worker);
+    return NULL;
+}
+
+int walk(const char *path, int rec, int need_stat, int nthreads, name_fn accept_name, visit_fn visit, finish_fn finish, void *arg){
+    struct walker walker = {0};
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        fprintf(output, "ERROR\ninvalid directory path\n");
+        return -1;
+    }
+    close(fd);
+    fprintf(output, "SUCCESS\n");
+
+    if(nthreads < 1){
+        nthreads = 1;
+    }
+    if(nthreads > MAX_THREADS){
+        nthreads = MAX_THREADS;
+    }
+    walker.nthreads = nthreads;
+    walker.rec = rec;
+    walker.need_stat = need_stat;
+    walker.accept_name = accept_name;
+    walker.visit = visit;
+    walker.finish = finish;
+    walker.arg = arg;
+    pthread_mutex_init(&walker.idle_lock, NULL);
+    pthread_cond_init(&walker.idle_cond, NULL);
+    walker.workers = (struct walk_worker*)calloc(nthreads, sizeof(struct walk_worker));
+    for(int i = 0; i < nthreads; i++){
+        walker.workers[i].walker = &walker;
+        walker.workers[i].id = i;
+        walker.workers[i].dents = (char*)malloc(DENTS_BUF_SIZE);
+        pthread_mutex_init(&walker.workers[i].deque.lock, NULL);
+    }
+
+    walk_push(&walker.workers[0], dir_task_new(NULL, path, 0));
+
+    for(int i = 1; i < nthreads; i++){
+        pthread_create(&walker.workers[i].thread, NULL, walk_worker_run, &walker.workers[i]);
+    }
+    walk_worker_run(&walker.workers[0]);
+    for(int i = 1; i < nthreads; i++){
+        pthread_join(walker.workers[i].thread, NULL);
+    }
+
+    for(int i = 0; i < nthreads; i++){
+        pthread_mutex_destroy(&walker.workers[i].deque.lock);
+        free(walker.workers[i].deque.tasks);
+        free(walker.workers[i].path);
+        free(walker.workers[i].dents);
+        free(walker.workers[i].out);
+    }
+    free(walker.workers);
+    pthread_cond_destroy(&walker.idle_cond);
+    pthread_mutex_destroy(&walker.idle_lock);
+    return 0;
+}
+
+struct filter_step{
+    int (*match)(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf);
+    long long value;
+    long long expect;
+    const char *str;
+    size_t len;
+};
+
+struct list_filter{
+    struct filter_step name_steps[FILTER_MAX_STEPS];
+    int name_count;
+    struct filter_step stat_steps[FILTER_MAX_STEPS];
+    int stat_count;
+};
+
+static int match_starts_with(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf){
+    return nameLen >= step->len && memcmp(name, step->str, step->len) == 0;
+}
+
+static int match_ends_with(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf){
+    return nameLen >= step->len && memcmp(name + nameLen - step->len, step->str, step->len) == 0;
+}
+
+static int match_size_smaller(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf){
+    return S_ISREG(statBuf->st_mode) && statBuf->st_size < step->value;
+}
+
+static int match_size_greater(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf){
+    return S_ISREG(statBuf->st_mode) && statBuf->st_size > step->value;
+}
+
+static int match_perm(const struct filter_step *step, const char *name, size_t nameLen, const struct stat *statBuf){
+    return (statBuf->st_mode & step->value) == step->expect;
+}
+
+static int parse_permissions(const char *str){
+    const char *symbols = "rwxrwxrwx";
+    int mode = 0;
+
+    if(strlen(str) != 9){
+        return -1;
+    }
+    for(int i = 0; i < 9; i++){
+        if(str[i] == symbols[i]){
+            mode |= 1 << (8 - i);
+        } else if(str[i] != '-'){
+            return -1;
+        }
+    }
+    return mode;
+}
+
+int list_filter_add(struct list_filter *filter, const char *arg){
+    struct filter_step step = {0};
+    int byName = 0;
+
+    if(strncmp(arg, "name_starts_with=", 17) == 0){
+        step.match = match_starts_with;
+        step.str = arg + 17;
+        byName = 1;
+    } else if(strncmp(arg, "name_ends_with=", 15) == 0){
+        step.match = match_ends_with;
+        step.str = arg + 15;
+        byName = 1;
+    } else if(strncmp(arg, "size_smaller=", 13) == 0){
+        step.match = match_size_smaller;
+        step.value = atoll(arg + 13);
+    } else if(strncmp(arg, "size_greater=", 13) == 0){
+        step.match = match_size_greater;
+        step.value = atoll(arg + 13);
+    } else if(strncmp(arg, "permissions=", 12) == 0){
+        step.match = match_perm;
+        step.value = 0777;
+        step.expect = parse_permissions(arg + 12);
+        if(step.expect < 0){
+            return -1;
+        }
+    } else if(strcmp(arg, "has_perm_execute") == 0){
+        step.match = match_perm;
+        step.value = step.expect = S_IXUSR;
+    } else if(strcmp(arg, "has_perm_write") == 0){
+        step.match = match_perm;
+        step.value = step.expect = S_IWUSR;
+    } else {
+        return 0;
+    }
+
+    if(byName){
+        step.len = strlen(step.str);
+        if(filter->name_count == FILTER_MAX_STEPS){
+            return -1;
+        }
+        filter->name_steps[filter->name_count++] = step;
+    } else {
+        if(filter->stat_count == FILTER_MAX_STEPS){
+            return -1;
+        }
+        filter->stat_steps[filter->stat_count++] = step;
+    }
+    return 1;
+}
+
+static int list_accept_name(void *arg, const char *name, size_t nameLen){
+    struct list_filter *filter = (struct list_filter*)arg;
+    for(int i = 0; i < filter->name_count; i++){
+        if(!filter->name_steps[i].match(&filter->name_steps[i], name, nameLen, NULL)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void list_visit(struct walk_worker *worker, int dirfd, const char *name, const char *path, const struct stat *statBuf){
+    struct list_filter *filter = (struct list_filter*)worker->walker->arg;
+    for(int i = 0; i < filter->stat_count; i++){
+        if(!filter->stat_steps[i].match(&filter->stat_steps[i], name, 0, statBuf)){
+            return;
+        }
+    }
+    walk_emit(worker, path);
+}
+
+void listDir(const char* path, const int rec, struct list_filter *filter, int nthreads){
+    walk(path, rec, filter->stat_count > 0, nthreads, filter->name_count > 0 ? list_accept_name : NULL, list_visit, NULL, filter);
+}
+
+static const char* find_newlines(const char *p, const char *end, int *count){
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    while(end - p >= 32){
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), nl32));
+        int found = __builtin_popcount(mask);
+        if(found >= *count){
+            while(--*count > 0){
+                mask &= mask - 1;
+            }
+            return p + __builtin_ctz(mask);
+        }
+        *count -= found;
+        p += 32;
     }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    while(end - p >= 16){
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl16));
+        int found = __builtin_popcount(mask);
+        if(found >= *count){
+            while(--*count > 0){
+                mask &= mask - 1;
+            }
+            return p + __builtin_ctz(mask);
+        }
+        *count -= found;
+        p += 16;
+    }
+#endif
+    for(; p < end; p++){
+        if(*p == '\n' && --*count == 0){
+            return p;
+        }
+    }
+    return NULL;
 }
 
-struct header parse(const char* path){
-    struct header header = {0};
-    header.section_headers = NULL;
+struct line_index_header{
+    char magic[4];
+    int no_of_sections;
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime;
+    long long size;
+};
+
+struct sf_file{
+    int fd;
+    struct stat statBuf;
+    struct header header;
+    char headerBuf[HEADER_FAST_SIZE];
+    char *map;
+    size_t map_len;
+    void *index_map;
+    size_t index_len;
+    const unsigned int *line_counts;
+    const unsigned int *newlines[14];
+};
 
-    int fd = open(path, O_RDONLY);
+struct index_job{
+    const char *data;
+    size_t size;
+    unsigned int *offsets;
+    unsigned int count;
+    unsigned int capacity;
+    pthread_t thread;
+};
 
-    if(fd == -1){
-        header.version = -5;
-        return header;
+static int sf_open(struct sf_file *file, const char *path){
+    memset(file, 0, sizeof(struct sf_file));
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(file->fd == -1){
+        return -1;
     }
+    if(fstat(file->fd, &file->statBuf) != 0 || parse_fd(file->fd, file->statBuf.st_size, file->headerBuf, &file->header) < 0){
+        close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+    return 0;
+}
 
-    lseek(fd, -4, SEEK_END);
-    read(fd, header.magic, 4);
-
-    if(strncmp(header.magic, MAGIC_VALUE, 4) != 0) {
-        close(fd);
-        header.version = -1;
-        return header;
+static int sf_map(struct sf_file *file){
+    if(file->map != NULL){
+        return 0;
+    }
+    file->map = (char*)mmap(NULL, file->statBuf.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if(file->map == MAP_FAILED){
+        file->map = NULL;
+        return -1;
     }
+    file->map_len = file->statBuf.st_size;
+    return 0;
+}
 
-    lseek(fd, -6, SEEK_END);
-    read(fd, &header.header_size, 2);
+static void sf_close(struct sf_file *file){
+    if(file->map != NULL){
+        munmap(file->map, file->map_len);
+    }
+    if(file->index_map != NULL){
+        munmap(file->index_map, file->index_len);
+    }
+    if(file->fd != -1){
+        close(file->fd);
+    }
+    file->fd = -1;
+}
 
-    lseek(fd, -header.header_size, SEEK_END);
+static int sf_section_valid(const struct sf_file *file, const struct section_header *sec){
+    return sec->sect_offset >= 0 && sec->sect_size >= 0 && (off_t)sec->sect_offset + sec->sect_size <= file->statBuf.st_size;
+}
 
-    read(fd, &header.version, 4);
+static char* line_index_path(const char *path, const char *dir, const struct stat *statBuf){
+    size_t len = (dir ? strlen(dir) : strlen(path)) + 48;
+    char *indexPath = (char*)malloc(len);
+    if(dir != NULL){
+        snprintf(indexPath, len, "%s/%llx-%llx.lidx", dir, (unsigned long long)statBuf->st_dev, (unsigned long long)statBuf->st_ino);
+    } else {
+        snprintf(indexPath, len, "%s.lidx", path);
+    }
+    return indexPath;
+}
 
-    if(header.version < 31 || header.version > 75){
+static int line_index_load(struct sf_file *file, const char *indexPath){
+    struct stat statBuf;
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    if(fstat(fd, &statBuf) != 0 || statBuf.st_size < (off_t)sizeof(struct line_index_header)){
         close(fd);
-        header.version = -2;
-        return header;
+        return -1;
+    }
+    void *map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        return -1;
     }
 
-    read(fd, &header.no_of_sections, 1);
-    if(header.no_of_sections != 2 && (header.no_of_sections < 8 || header.no_of_sections > 14)) {
-        close(fd);
-        header.version = -3;
-        return header;
+    const struct line_index_header *indexHeader = (const struct line_index_header*)map;
+    const unsigned int *counts = (const unsigned int*)(indexHeader + 1);
+    int n = file->header.no_of_sections;
+    size_t expected = sizeof(struct line_index_header) + n * sizeof(unsigned int);
+    if(memcmp(indexHeader->magic, LINE_INDEX_MAGIC, 4) != 0 || indexHeader->no_of_sections != n ||
+       indexHeader->dev != (unsigned long long)file->statBuf.st_dev || indexHeader->ino != (unsigned long long)file->statBuf.st_ino ||
+       indexHeader->mtime != (long long)file->statBuf.st_mtim.tv_sec * 1000000000LL + file->statBuf.st_mtim.tv_nsec ||
+       indexHeader->size != file->statBuf.st_size || (size_t)statBuf.st_size < expected){
+        munmap(map, statBuf.st_size);
+        return -1;
+    }
+    const unsigned int *offsets = counts + n;
+    for(int i = 0; i < n; i++){
+        file->newlines[i] = offsets;
+        offsets += counts[i];
+        expected += counts[i] * sizeof(unsigned int);
+        if((size_t)statBuf.st_size < expected){
+            munmap(map, statBuf.st_size);
+            return -1;
+        }
+    }
+    if((size_t)statBuf.st_size != expected){
+        munmap(map, statBuf.st_size);
+        return -1;
     }
+    file->index_map = map;
+    file->index_len = statBuf.st_size;
+    file->line_counts = counts;
+    return 0;
+}
 
-    header.section_headers = (struct section_header*) malloc(header.no_of_sections * sizeof(struct section_header));
+static void* index_section(void *arg){
+    struct index_job *job = (struct index_job*)arg;
+    const char *p = job->data;
+    const char *end = job->data + job->size;
 
-    if(!header.section_headers || 
-       read(fd, header.section_headers, header.no_of_sections * sizeof(struct section_header)) 
-       != header.no_of_sections * sizeof(struct section_header)) {
-        close(fd);
-        header.version = -3;
-        free_header(&header);
-        return header;
+    for(;;){
+        int one = 1;
+        p = find_newlines(p, end, &one);
+        if(p == NULL){
+            break;
+        }
+        if(job->count == job->capacity){
+            job->capacity = job->capacity ? job->capacity * 2 : 64;
+            job->offsets = (unsigned int*)realloc(job->offsets, job->capacity * sizeof(unsigned int));
+        }
+        job->offsets[job->count++] = p - job->data;
+        p++;
     }
+    return NULL;
+}
 
-    for(int i = 0; i < header.no_of_sections; i++) {
-        if(header.section_headers[i].sect_type != 90 && 
-           header.section_headers[i].sect_type != 13 && 
-           header.section_headers[i].sect_type != 82 && 
-           header.section_headers[i].sect_type != 39 && 
-           header.section_headers[i].sect_type != 81) {
-            close(fd);
-            header.version = -4;
-            free_header(&header);
-            return header;
+static int line_index_build(struct sf_file *file, const char *indexPath){
+    struct line_index_header indexHeader = {{0}};
+    struct index_job jobs[14];
+    int n = file->header.no_of_sections;
+    int ret = -1;
+
+    if(sf_map(file) != 0){
+        return -1;
+    }
+    memset(jobs, 0, sizeof(jobs));
+    for(int i = 0; i < n; i++){
+        if(!sf_section_valid(file, &file->header.section_headers[i])){
+            return -1;
         }
+        jobs[i].data = file->map + file->header.section_headers[i].sect_offset;
+        jobs[i].size = file->header.section_headers[i].sect_size;
+    }
+    for(int i = 1; i < n; i++){
+        pthread_create(&jobs[i].thread, NULL, index_section, &jobs[i]);
+    }
+    index_section(&jobs[0]);
+    for(int i = 1; i < n; i++){
+        pthread_join(jobs[i].thread, NULL);
     }
 
-    close(fd);
-    return header;
+    memcpy(indexHeader.magic, LINE_INDEX_MAGIC, 4);
+    indexHeader.no_of_sections = n;
+    indexHeader.dev = file->statBuf.st_dev;
+    indexHeader.ino = file->statBuf.st_ino;
+    indexHeader.mtime = (long long)file->statBuf.st_mtim.tv_sec * 1000000000LL + file->statBuf.st_mtim.tv_nsec;
+    indexHeader.size = file->statBuf.st_size;
+
+    size_t tmpLen = strlen(indexPath) + 5;
+    char *tmpPath = (char*)malloc(tmpLen);
+    snprintf(tmpPath, tmpLen, "%s.tmp", indexPath);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd != -1){
+        ret = write(fd, &indexHeader, sizeof(indexHeader)) == sizeof(indexHeader) ? 0 : -1;
+        for(int i = 0; i < n && ret == 0; i++){
+            ret = write(fd, &jobs[i].count, sizeof(unsigned int)) == sizeof(unsigned int) ? 0 : -1;
+        }
+        for(int i = 0; i < n && ret == 0; i++){
+            ssize_t size = jobs[i].count * sizeof(unsigned int);
+            ret = write(fd, jobs[i].offsets, size) == size ? 0 : -1;
+        }
+        close(fd);
+        if(ret == 0 && rename(tmpPath, indexPath) != 0){
+            ret = -1;
+        }
+        if(ret != 0){
+            unlink(tmpPath);
+        }
+    }
+    free(tmpPath);
+    for(int i = 0; i < n; i++){
+        free(jobs[i].offsets);
+    }
+    if(ret == 0){
+        ret = line_index_load(file, indexPath);
+    }
+    return ret;
 }
-void print_header(struct header header) {
-    printf("SUCCESS\n");
-    printf("version=%d\n", header.version);
-    printf("nr_sections=%d\n", header.no_of_sections);
 
-    for(int i = 0; i < header.no_of_sections; i++) {
-        char name[8] = {0};
-        strncpy(name, header.section_headers[i].sect_name, 7);
-        printf("section%d: %s %d %d\n", i + 1, name, header.section_headers[i].sect_type, header.section_headers[i].sect_size);
+static int line_index_open(struct sf_file *file, const char *path, const char *dir){
+    char *indexPath = line_index_path(path, dir, &file->statBuf);
+    int ret = line_index_load(file, indexPath);
+    if(ret != 0){
+        ret = line_index_build(file, indexPath);
     }
+    free(indexPath);
+    return ret;
+}
+
+static void emit_reversed(const char *start, const char *stop){
+    size_t len = stop - start;
+    char *out = (char*)malloc(len + 9);
+    memcpy(out, "SUCCESS\n", 8);
+    for(size_t i = 0; i < len; i++){
+        out[8 + i] = stop[-1 - (long)i];
+    }
+    out[8 + len] = '\n';
+    fwrite(out, 1, len + 9, output);
+    free(out);
 }
-void listDir(const char* path, const int rec, const long sizeThreshold, const char* name_ends_with){
-    DIR *dir = NULL;
-    struct dirent *entry = NULL;
-    char fullPath[1024];
-    struct stat statBuf;
-    static int firstCall = 1;
 
-    dir = opendir(path);
-    if(dir == NULL){
-        printf("ERROR\ninvalid directory path\n");
+static void extract_line(struct sf_file *file, int section, int line){
+    if (section < 1 || section > file->header.no_of_sections) {
+        fprintf(output, "ERROR\ninvalid section\n");
         return;
     }
 
-    if(firstCall){
-        printf("SUCCESS\n");
-        firstCall = 0;
+    struct section_header sec = file->header.section_headers[section - 1];
+
+    if(!sf_section_valid(file, &sec)){
+        fprintf(output, "ERROR\ninvalid file\n");
+        return;
     }
 
-    while((entry = readdir(dir)) != NULL){
-        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0){
-            snprintf(fullPath, 1024, "%s/%s", path, entry->d_name);
-            if(lstat(fullPath, &statBuf) == 0){
-                if((name_ends_with[0] == 0 || strcmp(entry->d_name + (strlen(entry->d_name) - strlen(name_ends_with)), name_ends_with) == 0) && 
-                (sizeThreshold == -1 || (S_ISREG(statBuf.st_mode) && statBuf.st_size < sizeThreshold))) {
-                    printf("%s\n", fullPath);
-                }
+    if(file->line_counts != NULL){
+        unsigned int count = file->line_counts[section - 1];
+        const unsigned int *newlines = file->newlines[section - 1];
+        if(line < 1 || (unsigned int)line > count + 1){
+            fprintf(output, "ERROR\ninvalid line\n");
+            return;
+        }
+        unsigned int from = line == 1 ? 0 : newlines[line - 2] + 1;
+        unsigned int to = (unsigned int)line <= count ? newlines[line - 1] : (unsigned int)sec.sect_size;
+        if(file->map != NULL){
+            emit_reversed(file->map + sec.sect_offset + from, file->map + sec.sect_offset + to);
+        } else {
+            char *buf = (char*)malloc(to - from + 1);
+            if(pread(file->fd, buf, to - from, sec.sect_offset + from) != (ssize_t)(to - from)){
+                fprintf(output, "ERROR\nread failed\n");
+            } else {
+                emit_reversed(buf, buf + (to - from));
+            }
+            free(buf);
+        }
+        return;
+    }
 
-                if(rec && S_ISDIR(statBuf.st_mode)){
-                    listDir(fullPath, rec, sizeThreshold, name_ends_with);
-                }
+    const char *data = "";
+    void *map = NULL;
+    size_t mapLen = 0;
+    if(file->map != NULL){
+        data = file->map + sec.sect_offset;
+    } else if(sec.sect_size > 0){
+        off_t mapStart = sec.sect_offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        mapLen = sec.sect_offset + sec.sect_size - mapStart;
+        map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, file->fd, mapStart);
+        if(map == MAP_FAILED){
+            fprintf(output, "ERROR\nread failed\n");
+            return;
+        }
+        madvise(map, mapLen, MADV_SEQUENTIAL);
+        data = (const char*)map + (sec.sect_offset - mapStart);
+    }
+
+    const char *end = data + sec.sect_size;
+    const char *start = data;
+    int skip = line - 1;
+    if(line < 1 || (skip > 0 && (start = find_newlines(data, end, &skip)) == NULL)){
+        fprintf(output, "ERROR\ninvalid line\n");
+    } else {
+        if(line > 1){
+            start++;
+        }
+        int one = 1;
+        const char *stop = find_newlines(start, end, &one);
+        emit_reversed(start, stop != NULL ? stop : end);
+    }
+
+    if(map != NULL){
+        munmap(map, mapLen);
+    }
+}
+
+struct open_file{
+    char *path;
+    struct sf_file file;
+    int indexed;
+    unsigned long last_use;
+};
+
+struct serve_state{
+    struct header_cache *cache;
+    struct open_file files[OPEN_FILES_MAX];
+    unsigned long clock;
+};
+
+static struct sf_file* serve_file(struct serve_state *state, const char *path, int useIndex, const char *indexDir){
+    struct open_file *slot = NULL;
+    struct stat statBuf;
+
+    if(stat(path, &statBuf) != 0){
+        return NULL;
+    }
+    for(int i = 0; i < OPEN_FILES_MAX; i++){
+        struct open_file *entry = &state->files[i];
+        if(entry->path != NULL && strcmp(entry->path, path) == 0){
+            if(entry->file.statBuf.st_dev == statBuf.st_dev && entry->file.statBuf.st_ino == statBuf.st_ino &&
+               entry->file.statBuf.st_size == statBuf.st_size &&
+               entry->file.statBuf.st_mtim.tv_sec == statBuf.st_mtim.tv_sec && entry->file.statBuf.st_mtim.tv_nsec == statBuf.st_mtim.tv_nsec){
+                slot = entry;
+            } else {
+                sf_close(&entry->file);
+                free(entry->path);
+                entry->path = NULL;
+            }
+            break;
+        }
+    }
+    if(slot == NULL){
+        slot = &state->files[0];
+        for(int i = 0; i < OPEN_FILES_MAX && slot->path != NULL; i++){
+            if(state->files[i].path == NULL || state->files[i].last_use < slot->last_use){
+                slot = &state->files[i];
             }
         }
+        if(slot->path != NULL){
+            sf_close(&slot->file);
+            free(slot->path);
+            slot->path = NULL;
+        }
+        if(sf_open(&slot->file, path) != 0){
+            return NULL;
+        }
+        sf_map(&slot->file);
+        slot->path = strdup(path);
+        slot->indexed = 0;
     }
-    closedir(dir);
+    if(useIndex && !slot->indexed){
+        line_index_open(&slot->file, path, indexDir);
+        slot->indexed = 1;
+    }
+    slot->last_use = ++state->clock;
+    return &slot->file;
 }
 
-void extract(const char* path, int section, int line){
-    struct header header = {0};
-    int fd = -1;
-    char *buffer = NULL;
+static void extract_pairs(struct sf_file *file, int section, int line, const char *lines){
+    if(lines == NULL){
+        extract_line(file, section, line);
+        return;
+    }
+    while(*lines != 0){
+        char *next = NULL;
+        section = strtol(lines, &next, 10);
+        line = -1;
+        if(*next == ':'){
+            line = strtol(next + 1, &next, 10);
+        }
+        extract_line(file, section, line);
+        lines = next;
+        while(*lines != 0 && *lines != ','){
+            lines++;
+        }
+        if(*lines == ','){
+            lines++;
+        }
+    }
+}
+
+void extract(const char* path, int section, int line, const char *lines, int useIndex, const char *indexDir, struct serve_state *state){
+    struct sf_file file;
 
-    header = parse(path);
-    
-    if (header.version < 0) {
-        printf("ERROR\ninvalid file\n");
+    if(state != NULL){
+        struct sf_file *cached = serve_file(state, path, useIndex, indexDir);
+        if(cached == NULL){
+            fprintf(output, "ERROR\ninvalid file\n");
+            return;
+        }
+        extract_pairs(cached, section, line, lines);
         return;
     }
 
-    if (section < 1 || section > header.no_of_sections) {
-        printf("ERROR\ninvalid section\n");
-        free_header(&header);
+    if(sf_open(&file, path) != 0){
+        fprintf(output, "ERROR\ninvalid file\n");
         return;
     }
+    if(useIndex){
+        line_index_open(&file, path, indexDir);
+    }
+    if(lines != NULL){
+        sf_map(&file);
+    }
+    extract_pairs(&file, section, line, lines);
+    sf_close(&file);
+}
 
-    struct section_header sec = header.section_headers[section - 1];
+void build_index(const char *path, const char *indexDir){
+    struct sf_file file;
 
-    fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        printf("ERROR\ninvalid file\n");
-        free_header(&header);
+    if(sf_open(&file, path) != 0){
+        fprintf(output, "ERROR\ninvalid file\n");
         return;
     }
+    char *indexPath = line_index_path(path, indexDir, &file.statBuf);
+    if(line_index_build(&file, indexPath) == 0){
+        fprintf(output, "SUCCESS\n%s\n", indexPath);
+    } else {
+        fprintf(output, "ERROR\ncannot write index\n");
+    }
+    free(indexPath);
+    sf_close(&file);
+}
 
-    lseek(fd, sec.sect_offset, SEEK_SET);
+struct uring{
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int sqe_tail;
+    unsigned int to_submit;
+};
 
-    buffer = (char*)malloc(sec.sect_size + 1);
-    if (!buffer) {
-        printf("ERROR\nmemory allocation failed\n");
-        close(fd);
-        free_header(&header);
-        return;
+static int uring_init(struct uring *ring, unsigned int entries){
+    struct io_uring_params params;
+    unsigned char probeBuf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    struct io_uring_probe *probe = (struct io_uring_probe*)probeBuf;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0){
+        return -1;
     }
 
-    ssize_t bytes_read = read(fd, buffer, sec.sect_size);
-    close(fd);
+    memset(probeBuf, 0, sizeof(probeBuf));
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+       probe->last_op < IORING_OP_READ ||
+       !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)){
+        close(ring->fd);
+        return -1;
+    }
 
-    if (bytes_read != sec.sect_size) {
-        printf("ERROR\nread failed\n");
-        free(buffer);
-        free_header(&header);
-        return;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED){
+        if(ring->sq_ring != MAP_FAILED){
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if(ring->cq_ring != MAP_FAILED){
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if(ring->sqes != MAP_FAILED){
+            munmap(ring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_head = (unsigned int*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+static void uring_exit(struct uring *ring){
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// SQEs are only reserved here; the caller fills them in and uring_enter()
+// publishes the new tail, so the kernel never sees a half-written entry.
+static struct io_uring_sqe* uring_sqe(struct uring *ring){
+    unsigned int index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+static int uring_enter(struct uring *ring, unsigned int wait){
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(ret >= 0){
+        ring->to_submit -= ret;
     }
+    return ret;
+}
 
-    buffer[sec.sect_size] = '\0';
+enum{
+    SCAN_STATX,
+    SCAN_OPEN,
+    SCAN_READ_TRAILER,
+    SCAN_READ_TABLE,
+    SCAN_CLOSE
+};
 
-    char *start = buffer;
-    char *end = NULL;
-    int current_line = 1;
+struct scan_file{
+    int state;
+    int fd;
+    struct dir_ref *dir;
+    off_t size;
+    int avail;
+    char *path;
+    size_t name_off;
+    struct stat statBuf;
+    struct statx statxBuf;
+    struct header header;
+    char buf[HEADER_FAST_SIZE];
+};
 
-    for (int i = 0; i < sec.sect_size; i++) {
-        if (buffer[i] == '\n' || i == sec.sect_size - 1) {
-            if (current_line == line) {
-                end = &buffer[i];
-                break;
-            }
-            start = &buffer[i + 1];
-            current_line++;
+struct scanner{
+    struct uring ring;
+    struct scan_file files[URING_DEPTH];
+    int free_list[URING_DEPTH];
+    int free_count;
+};
+
+struct findall_ctx{
+    struct header_cache *cache;
+    int use_uring;
+};
+
+static int findall_match(const struct header *header){
+    if(header->version < 0){
+        return 0;
+    }
+    for(int i = 0; i < header->no_of_sections; i++){
+        if(header->section_headers[i].sect_size > 1416){
+            return 0;
         }
     }
+    return 1;
+}
 
-    if (!end || current_line < line) {
-        printf("ERROR\ninvalid line\n");
-        free(buffer);
-        free_header(&header);
+static void scan_finish_file(struct walk_worker *worker, struct scan_file *file, int parsed){
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+    struct findall_ctx *ctx = (struct findall_ctx*)worker->walker->arg;
+
+    if(parsed){
+        if(ctx->cache != NULL){
+            cache_store(ctx->cache, &file->statBuf, &file->header);
+        }
+        if(findall_match(&file->header)){
+            walk_emit(worker, file->path);
+        }
+    }
+    dir_ref_put(file->dir);
+    file->dir = NULL;
+    if(file->fd >= 0){
+        struct io_uring_sqe *sqe = uring_sqe(&scanner->ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = file->fd;
+        sqe->user_data = file - scanner->files;
+        file->state = SCAN_CLOSE;
+        file->fd = -1;
         return;
     }
+    free(file->path);
+    file->path = NULL;
+    scanner->free_list[scanner->free_count++] = file - scanner->files;
+}
+
+static void scan_read(struct scanner *scanner, struct scan_file *file, int len, off_t offset, int state){
+    struct io_uring_sqe *sqe = uring_sqe(&scanner->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (unsigned long)file->buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = file - scanner->files;
+    file->state = state;
+}
+
+static void scan_open(struct scanner *scanner, struct scan_file *file){
+    struct io_uring_sqe *sqe = uring_sqe(&scanner->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = file->dir->fd;
+    sqe->addr = (unsigned long)(file->path + file->name_off);
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = file - scanner->files;
+    file->state = SCAN_OPEN;
+}
+
+static void scan_complete(struct walk_worker *worker, struct scan_file *file, int res){
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+
+    switch(file->state){
+        case SCAN_STATX:
+            if(res < 0 || !S_ISREG(file->statxBuf.stx_mode)){
+                scan_finish_file(worker, file, 0);
+                return;
+            }
+            file->size = file->statxBuf.stx_size;
+            scan_open(scanner, file);
+            return;
+        case SCAN_OPEN:
+            if(res < 0){
+                scan_finish_file(worker, file, 0);
+                return;
+            }
+            file->fd = res;
+            dir_ref_put(file->dir);
+            file->dir = NULL;
+            if(file->size < 6){
+                file->header.version = -1;
+                scan_finish_file(worker, file, 1);
+                return;
+            }
+            file->avail = file->size < HEADER_FAST_SIZE ? file->size : HEADER_FAST_SIZE;
+            scan_read(scanner, file, file->avail, file->size - file->avail, SCAN_READ_TRAILER);
+            return;
+        case SCAN_READ_TRAILER:
+            if(res != file->avail){
+                file->header.version = -1;
+                scan_finish_file(worker, file, 1);
+                return;
+            }
+            if(parse_trailer(file->buf, file->avail, file->size, &file->header) < 0){
+                scan_finish_file(worker, file, 1);
+                return;
+            }
+            if(file->header.header_size > file->avail){
+                file->avail = file->header.header_size - 6 < HEADER_TABLE_MAX ? file->header.header_size - 6 : HEADER_TABLE_MAX;
+                scan_read(scanner, file, file->avail, file->size - file->header.header_size, SCAN_READ_TABLE);
+                return;
+            }
+            parse_table(file->buf + file->avail - file->header.header_size, file->header.header_size - 6, &file->header);
+            scan_finish_file(worker, file, 1);
+            return;
+        case SCAN_READ_TABLE:
+            if(res != file->avail){
+                file->header.version = -2;
+            } else {
+                parse_table(file->buf, file->avail, &file->header);
+            }
+            scan_finish_file(worker, file, 1);
+            return;
+        case SCAN_CLOSE:
+            free(file->path);
+            file->path = NULL;
+            scanner->free_list[scanner->free_count++] = file - scanner->files;
+            return;
+    }
+}
+
+// Returns -1 when io_uring_enter() fails for good; the ring is then unusable.
+static int scan_reap(struct walk_worker *worker, unsigned int wait){
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+    struct uring *ring = &scanner->ring;
+
+    if(ring->to_submit > 0 || wait > 0){
+        if(uring_enter(ring, wait) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN){
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+    unsigned int head = *ring->cq_head;
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct scan_file *file = &scanner->files[cqe->user_data];
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        scan_complete(worker, file, res);
+        head = *ring->cq_head;
+    }
+    return 0;
+}
+
+static void findall_sync(struct walk_worker *worker, int dirfd, const char *name, const char *path, const struct stat *statBuf){
+    struct findall_ctx *ctx = (struct findall_ctx*)worker->walker->arg;
+    struct stat fileStat;
+    struct header header;
+    char headerBuf[HEADER_FAST_SIZE];
 
-    printf("SUCCESS\n");
-    for (char *ptr = end - 1; ptr >= start; ptr--) {
-        printf("%c", *ptr);
+    if(statBuf->st_nlink == 0){
+        if(fstatat(dirfd, name, &fileStat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(fileStat.st_mode)){
+            return;
+        }
+        statBuf = &fileStat;
+    }
+    if(ctx->cache == NULL || !cache_lookup(ctx->cache, statBuf, headerBuf, &header)){
+        int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+        if(fd == -1){
+            return;
+        }
+        parse_fd(fd, statBuf->st_size, headerBuf, &header);
+        close(fd);
+        if(ctx->cache != NULL){
+            cache_store(ctx->cache, statBuf, &header);
+        }
+    }
+    if(findall_match(&header)){
+        walk_emit(worker, path);
     }
-    printf("\n");
+}
+
+// Gives up on a ring whose io_uring_enter() keeps failing: files still in
+// flight are scanned again synchronously and the worker stays on that path.
+// The scanner itself is leaked on purpose, since requests the kernel had
+// already picked up may still write into it.
+static void findall_abort(struct walk_worker *worker){
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+    struct findall_ctx *ctx = (struct findall_ctx*)worker->walker->arg;
+    struct stat statBuf;
+
+    uring_exit(&scanner->ring);
+    worker->ctx = NULL;
+    __atomic_store_n(&ctx->use_uring, 0, __ATOMIC_RELAXED);
 
-    free(buffer);
-    free_header(&header);
+    memset(&statBuf, 0, sizeof(statBuf));
+    for(int i = 0; i < URING_DEPTH; i++){
+        struct scan_file *file = &scanner->files[i];
+        if(file->path == NULL || file->state == SCAN_CLOSE){
+            continue;
+        }
+        if(file->fd >= 0){
+            close(file->fd);
+        }
+        findall_sync(worker, AT_FDCWD, file->path, file->path, &statBuf);
+    }
 }
 
-void findall(const char* path){
-    DIR *dir = NULL;
-    struct dirent *entry = NULL;
-    char fullPath[512];
-    struct stat statbuf;
-    static int firstCall = 1;
+static void findall_visit(struct walk_worker *worker, int dirfd, const char *name, const char *path, const struct stat *statBuf){
+    struct findall_ctx *ctx = (struct findall_ctx*)worker->walker->arg;
 
-    dir = opendir(path);
-    if(dir == NULL){
-        printf("ERROR\ninvalid directory path\n");
+    if(!S_ISREG(statBuf->st_mode)){
+        return;
+    }
+    if(ctx->use_uring && worker->ctx == NULL){
+        struct scanner *scanner = (struct scanner*)calloc(1, sizeof(struct scanner));
+        if(scanner != NULL && uring_init(&scanner->ring, URING_DEPTH) == 0){
+            for(int i = 0; i < URING_DEPTH; i++){
+                scanner->files[i].fd = -1;
+                scanner->free_list[scanner->free_count++] = URING_DEPTH - 1 - i;
+            }
+            worker->ctx = scanner;
+        } else {
+            free(scanner);
+            __atomic_store_n(&ctx->use_uring, 0, __ATOMIC_RELAXED);
+        }
+    }
+    if(worker->ctx == NULL){
+        findall_sync(worker, dirfd, name, path, statBuf);
         return;
     }
 
-    if(firstCall){
-        printf("SUCCESS\n");
-        firstCall = 0;
-    }
-
-    while((entry = readdir(dir)) != NULL){
-        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0){
-            snprintf(fullPath, 512, "%s/%s", path, entry->d_name);
-            if(lstat(fullPath, &statbuf) == 0){
-                if(S_ISDIR(statbuf.st_mode)){
-                    findall(fullPath);
-                } else if(S_ISREG(statbuf.st_mode)){
-                    struct header header = parse(fullPath);
-                    if(header.version >= 0){
-                        int ok = 1;
-                        for(int i = 0; i < header.no_of_sections; i++){
-                            if(header.section_headers[i].sect_size > 1416){
-                                ok = 0;
-                                break;
-                            }
-                        }
-                        if(ok){
-                            printf("%s\n", fullPath);
-                        }
-                    }
-                    free_header(&header);
-                }
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+    if(ctx->cache != NULL){
+        struct header header;
+        char headerBuf[HEADER_FAST_SIZE];
+        if(cache_lookup(ctx->cache, statBuf, headerBuf, &header)){
+            if(findall_match(&header)){
+                walk_emit(worker, path);
             }
+            return;
+        }
+    }
+    while(scanner->free_count == 0){
+        if(scan_reap(worker, 1) < 0){
+            findall_abort(worker);
+            findall_sync(worker, dirfd, name, path, statBuf);
+            return;
+        }
+    }
+
+    struct scan_file *file = &scanner->files[scanner->free_list[--scanner->free_count]];
+    size_t pathLen = strlen(path);
+    file->path = (char*)malloc(pathLen + 1);
+    memcpy(file->path, path, pathLen + 1);
+    file->name_off = pathLen - strlen(name);
+    file->fd = -1;
+    file->dir = worker->dir;
+    __atomic_add_fetch(&file->dir->refs, 1, __ATOMIC_RELAXED);
+    memset(&file->header, 0, sizeof(file->header));
+
+    if(statBuf->st_nlink != 0){
+        file->statBuf = *statBuf;
+        file->size = statBuf->st_size;
+        scan_open(scanner, file);
+    } else {
+        struct io_uring_sqe *sqe = uring_sqe(&scanner->ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = file->dir->fd;
+        sqe->addr = (unsigned long)(file->path + file->name_off);
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (unsigned long)&file->statxBuf;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = file - scanner->files;
+        file->state = SCAN_STATX;
+    }
+    if(scanner->ring.to_submit >= URING_BATCH && scan_reap(worker, 0) < 0){
+        findall_abort(worker);
+    }
+}
+
+static void findall_finish(struct walk_worker *worker){
+    struct scanner *scanner = (struct scanner*)worker->ctx;
+
+    if(scanner == NULL){
+        return;
+    }
+    while(scanner->free_count < URING_DEPTH){
+        if(scan_reap(worker, 1) < 0){
+            findall_abort(worker);
+            return;
         }
     }
-    closedir(dir);
+    uring_exit(&scanner->ring);
+    free(scanner);
+    worker->ctx = NULL;
+}
+
+void findall(const char* path, int nthreads, struct header_cache *cache, int useUring){
+    struct findall_ctx ctx = {cache, useUring};
+    walk(path, 1, !useUring || cache != NULL, nthreads, NULL, findall_visit, findall_finish, &ctx);
 }
 
-int main(int argc, char **argv) 
+int run_command(int argc, char **argv, struct serve_state *state)
 {
+    struct header_cache *state_cache = state != NULL ? state->cache : NULL;
     if(argc >= 2) {
         if(strcmp(argv[1], "variant") == 0) {
-            printf("75664\n");
+            fprintf(output, "75664\n");
         }
         else if(strcmp(argv[1], "list") == 0){
             char *path = NULL;
             int rec = 0;
-            long sizeThreshold = -1;
-            char name_ends_with[1024] = {0};
+            struct list_filter filter;
+            int nthreads = 1;
+            int valid = 1;
+            memset(&filter, 0, sizeof(filter));
             for(int i = 2; i < argc; i++){
                 if(strcmp(argv[i], "recursive") == 0){
                     rec = 1;
@@ -290,47 +1807,57 @@ int main(int argc, char **argv)
                     path = argv[i] + 5;
                     break;
                 }
-                if(strncmp(argv[i], "size_smaller=", 13) == 0){
-                    sizeThreshold = atol(argv[i] + 13);
+                if(list_filter_add(&filter, argv[i]) < 0){
+                    valid = 0;
                 }
-                if(strncmp(argv[i], "name_ends_with=", 15) == 0) {
-                    strcpy(name_ends_with, argv[i] + 15);
+                if(strncmp(argv[i], "threads=", 8) == 0){
+                    nthreads = atoi(argv[i] + 8);
                 }
             }
-            listDir(path, rec, sizeThreshold, name_ends_with);
+            if(path && valid){
+                listDir(path, rec, &filter, nthreads);
+            } else fprintf(output, "ERROR\ninvalid arguments\n");
         }
         else if(strcmp(argv[1], "parse") == 0){
             char *path = NULL;
+            struct header_cache *cache = state_cache;
             for(int i = 2; i < argc; i++){
+                if(strncmp(argv[i], "cache=", 6) == 0 && cache == state_cache){
+                    cache = cache_open(argv[i] + 6);
+                }
                 if(strncmp(argv[i], "path=", 5) == 0){
                     path = argv[i] + 5;
                     break;
                 }
             }
-            struct header header = parse(path);
+            char headerBuf[HEADER_FAST_SIZE];
+            struct header header = parse(path, headerBuf, cache);
             if(header.version == -1){
-                printf("ERROR\nwrong magic\n");
+                fprintf(output, "ERROR\nwrong magic\n");
             } 
             else if(header.version == -2){
-                printf("ERROR\nwrong version\n");
+                fprintf(output, "ERROR\nwrong version\n");
             }
             else if(header.version == -3){
-                printf("ERROR\nwrong sect_nr\n");
+                fprintf(output, "ERROR\nwrong sect_nr\n");
             }
             else if(header.version == -4){
-                printf("ERROR\nwrong sect_types\n");   
+                fprintf(output, "ERROR\nwrong sect_types\n");   
             }
             else {
                 print_header(header);
             }
-            if(header.section_headers != NULL){
-                free_header(&header);
+            if(cache != state_cache){
+                cache_close(cache);
             }
         }
         else if(strcmp(argv[1], "extract") == 0){
             char *path = NULL;
             int section = -1;
             int line = -1;
+            char *lines = NULL;
+            int useIndex = 0;
+            char *indexDir = NULL;
             for(int i = 2; i < argc; i++){
                 if(strncmp(argv[i], "path=", 5) == 0){
                     path = argv[i] + 5;
@@ -341,23 +1868,174 @@ int main(int argc, char **argv)
                 if(strncmp(argv[i], "line=", 5) == 0){
                     line = atoi(argv[i] + 5);
                 }
+                if(strncmp(argv[i], "lines=", 6) == 0){
+                    lines = argv[i] + 6;
+                }
+                if(strcmp(argv[i], "index") == 0){
+                    useIndex = 1;
+                }
+                if(strncmp(argv[i], "index=", 6) == 0){
+                    useIndex = 1;
+                    indexDir = argv[i] + 6;
+                }
+            }
+            if(path && (lines || (section != -1 && line != -1))){
+                extract(path, section, line, lines, useIndex, indexDir, state);
+            } else fprintf(output, "ERROR\ninvalid arguments\n");
+        }
+        else if(strcmp(argv[1], "index") == 0){
+            char *path = NULL;
+            char *indexDir = NULL;
+            for(int i = 2; i < argc; i++){
+                if(strncmp(argv[i], "path=", 5) == 0){
+                    path = argv[i] + 5;
+                }
+                if(strncmp(argv[i], "index=", 6) == 0){
+                    indexDir = argv[i] + 6;
+                }
             }
-            if(path && section != -1 && line != -1){
-                extract(path, section, line);
-            } else printf("ERROR\ninvalid arguments\n");
+            if(path){
+                build_index(path, indexDir);
+            } else fprintf(output, "ERROR\ninvalid arguments\n");
         }
         else if(strcmp(argv[1], "findall") == 0){
             char *path = NULL;
+            int nthreads = 1;
+            struct header_cache *cache = state_cache;
+            int useUring = 0;
             for(int i = 2; i < argc; i++){
+                if(strncmp(argv[i], "threads=", 8) == 0){
+                    nthreads = atoi(argv[i] + 8);
+                }
+                if(strcmp(argv[i], "io=uring") == 0){
+                    useUring = 1;
+                }
+                if(strncmp(argv[i], "cache=", 6) == 0 && cache == state_cache){
+                    cache = cache_open(argv[i] + 6);
+                }
                 if(strncmp(argv[i], "path=", 5) == 0){
                     path = argv[i] + 5;
                     break;
                 }
             }
             if(path){
-                findall(path);
-            } else printf("ERROR\ninvalid arguments\n");
+                findall(path, nthreads, cache, useUring);
+            } else fprintf(output, "ERROR\ninvalid arguments\n");
+            if(cache != state_cache){
+                cache_close(cache);
+            }
+        }
+    }
+    return 0;
+}
+
+// Splits a serve command line into words, in place. Words are separated
+// by blanks; a backslash takes the next character literally and double
+// quotes group blanks into a word, so "path=my dir/f" or path=my\ dir/f
+// name a path with a space. Returns the number of words added after
+// args[first], or -1 with *error set when the line has more than max - first
+// words or an open quote or trailing backslash.
+static int serve_split(char *line, char **args, int first, int max, const char **error){
+    char *in = line;
+    char *out = line;
+    int nargs = first;
+
+    for(;;){
+        while(*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n'){
+            in++;
+        }
+        if(*in == 0){
+            return nargs - first;
+        }
+        if(nargs == max){
+            *error = "too many arguments";
+            return -1;
+        }
+        args[nargs++] = out;
+        int quoted = 0;
+        while(*in != 0 && (quoted || (*in != ' ' && *in != '\t' && *in != '\r' && *in != '\n'))){
+            if(*in == '"'){
+                quoted = !quoted;
+                in++;
+                continue;
+            }
+            if(*in == '\\' && (*++in == 0 || *in == '\n')){
+                *error = "trailing backslash";
+                return -1;
+            }
+            *out++ = *in++;
+        }
+        if(quoted){
+            *error = "unterminated quote";
+            return -1;
+        }
+        if(*in != 0){
+            in++;
+        }
+        *out++ = 0;
+    }
+}
+
+int serve(int argc, char **argv){
+    struct serve_state state;
+    char *line = NULL;
+    size_t cap = 0;
+    char *cachePath = NULL;
+
+    for(int i = 2; i < argc; i++){
+        if(strncmp(argv[i], "cache=", 6) == 0){
+            cachePath = argv[i] + 6;
+        }
+    }
+    memset(&state, 0, sizeof(state));
+    state.cache = cache_open(cachePath);
+
+    while(getline(&line, &cap, stdin) > 0){
+        char *args[SERVE_MAX_ARGS];
+        const char *error = NULL;
+        args[0] = argv[0];
+        int nargs = 1 + serve_split(line, args, 1, SERVE_MAX_ARGS, &error);
+        if(nargs == 1){
+            continue;
+        }
+        if(error == NULL && strcmp(args[1], "quit") == 0){
+            break;
+        }
+
+        char *response = NULL;
+        size_t len = 0;
+        output = open_memstream(&response, &len);
+        if(error != NULL){
+            fprintf(output, "ERROR\n%s\n", error);
+        } else if(strcmp(args[1], "serve") == 0){
+            fprintf(output, "ERROR\ninvalid arguments\n");
+        } else {
+            run_command(nargs, args, &state);
+        }
+        fclose(output);
+        output = stdout;
+        fprintf(stdout, "%zu\n", len);
+        fwrite(response, 1, len, stdout);
+        fflush(stdout);
+        free(response);
+    }
+
+    free(line);
+    for(int i = 0; i < OPEN_FILES_MAX; i++){
+        if(state.files[i].path != NULL){
+            sf_close(&state.files[i].file);
+            free(state.files[i].path);
         }
     }
+    cache_close(state.cache);
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    output = stdout;
+    if(argc >= 2 && strcmp(argv[1], "serve") == 0){
+        return serve(argc, argv);
+    }
+    return run_command(argc, argv, NULL);
+}
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+import os, sys, subprocess, json, base64, random, shutil, time, tempfile
+import argparse, statistics
+
+import tester
+
+A1_PROG = "a1"
+CORPUS_FILE_NAME = "corpus.json"
+SAMPLE_SIZE = 1000
+
+# ru_maxrss survives exec, so a child forked straight from this (large) python
+# process would report python's peak; fork a1 from a small C runner instead.
+RUNNER_SRC = r"""
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+int main(int argc, char **argv){
+    struct rusage usage;
+    int status = 0;
+    pid_t pid = fork();
+    if(pid == 0){
+        execvp(argv[2], argv + 2);
+        _exit(127);
+    }
+    if(pid < 0 || wait4(pid, &status, 0, &usage) < 0){
+        return 1;
+    }
+    FILE *out = fopen(argv[1], "w");
+    fprintf(out, "%ld %ld.%06ld %ld.%06ld %d\n", usage.ru_maxrss,
+            (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec,
+            (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec,
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fclose(out);
+    return 0;
+}
+"""
+
+def loadData():
+    with open("a1_data.json") as a1_data:
+        return json.loads(base64.b64decode(a1_data.read()).decode("utf-8"))
+
+def makeDirs(path, count, maxDepth):
+    dirs = [(path, 0)]
+    seen = set([path])
+    for _i in range(count):
+        crtDir, depth = dirs[random.randint(0, len(dirs)-1)]
+        while depth >= maxDepth:
+            crtDir, depth = dirs[random.randint(0, len(dirs)-1)]
+        newDir = os.path.join(crtDir, tester.genRandomName())
+        while newDir in seen:
+            newDir += tester.genRandomName(1)
+        seen.add(newDir)
+        dirs.append((newDir, depth + 1))
+    for dir, _depth in dirs:
+        os.mkdir(dir)
+    return [dir for dir, _depth in dirs]
+
+def makeFiles(data, count, dirs, corruptedRatio):
+    corruptions = ["wrongMagic", "wrongVersion", "wrongSectNr", "wrongSectTypes"]
+    seen = set()
+    valid = []
+    nrCorrupted = 0
+    for i in range(count):
+        crtDir = dirs[random.randint(0, len(dirs)-1)]
+        newFile = os.path.join(crtDir, b"%s.%s" % (tester.genRandomName(), tester.genRandomName(3)))
+        while newFile in seen:
+            newFile += tester.genRandomName(1)
+        seen.add(newFile)
+        if random.random() < corruptedRatio:
+            tester.genSectionFile(newFile, data, **{corruptions[nrCorrupted % 4]: True})
+            nrCorrupted += 1
+        else:
+            tester.genSectionFile(newFile, data)
+            if len(valid) < SAMPLE_SIZE:
+                valid.append(newFile.decode())
+        if (i + 1) % 10000 == 0:
+            print("\t%d / %d files" % (i + 1, count), file=sys.stderr)
+    return valid, nrCorrupted
+
+def buildCorpus(data, args):
+    params = {
+        "files": args.files,
+        "dirs": args.dirs if args.dirs is not None else max(1, args.files // 10),
+        "depth": args.depth,
+        "sections": args.sections,
+        "corrupted": args.corrupted,
+        "seed": args.seed,
+    }
+    manifestPath = os.path.join(args.root, CORPUS_FILE_NAME)
+    if not args.regenerate and os.path.isfile(manifestPath):
+        with open(manifestPath) as fin:
+            manifest = json.load(fin)
+        if manifest["params"] == params:
+            return manifest
+
+    if os.path.isdir(args.root):
+        shutil.rmtree(args.root)
+    print("Generating corpus in %s (this may take a while)..." % args.root, file=sys.stderr)
+    random.seed(args.seed)
+    data = dict(data)
+    data["nr_sect_min"], data["nr_sect_max"] = args.sections.split(":")
+    os.mkdir(args.root)
+    tree = os.path.join(args.root, "tree")
+    dirs = makeDirs(tree.encode(), params["dirs"], args.depth)
+    valid, nrCorrupted = makeFiles(data, args.files, dirs, args.corrupted)
+    manifest = {
+        "params": params,
+        "tree": tree,
+        "entries": len(dirs) - 1 + args.files,
+        "corrupted": nrCorrupted,
+        "sample": valid,
+    }
+    with open(manifestPath, "w") as fout:
+        json.dump(manifest, fout, indent=4)
+    return manifest
+
+def compile(cflags, workDir):
+    cmd = ["gcc", "-Wall"] + cflags + ["%s.c" % A1_PROG, "-o", A1_PROG]
+    if subprocess.call(cmd) != 0 or not os.path.isfile(A1_PROG):
+        print("COMPILATION ERROR", file=sys.stderr)
+        sys.exit(1)
+    runnerSrc = os.path.join(workDir, "runner.c")
+    runner = os.path.join(workDir, "runner")
+    with open(runnerSrc, "w") as fout:
+        fout.write(RUNNER_SRC)
+    if subprocess.call(["gcc", "-O2", runnerSrc, "-o", runner]) != 0:
+        sys.exit(1)
+    return runner
+
+def runOnce(runner, cmd, inputPath):
+    fin = open(inputPath, "rb") if inputPath is not None else subprocess.DEVNULL
+    with tempfile.NamedTemporaryFile("r", suffix=".rusage") as out:
+        t1 = time.perf_counter()
+        subprocess.call([runner, out.name] + cmd, stdin=fin, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        t2 = time.perf_counter()
+        maxrss, utime, stime, exitCode = out.read().split()
+    if inputPath is not None:
+        fin.close()
+    return {
+        "wall_sec": t2 - t1,
+        "user_sec": float(utime),
+        "sys_sec": float(stime),
+        "peak_rss_kb": int(maxrss),
+        "exit_code": int(exitCode),
+    }
+
+def countSyscalls(cmd, inputPath):
+    if shutil.which("strace") is None:
+        return None
+    with tempfile.NamedTemporaryFile("r", suffix=".strace") as out:
+        fin = open(inputPath, "rb") if inputPath is not None else subprocess.DEVNULL
+        subprocess.call(["strace", "-f", "-c", "-o", out.name] + cmd, stdin=fin,
+                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        if inputPath is not None:
+            fin.close()
+        for line in out.read().split("\n"):
+            tokens = line.split()
+            if len(tokens) >= 4 and tokens[-1] == "total":
+                return int(tokens[3])
+    return None
+
+def benchmark(runner, name, cmd, files, runs, inputPath=None):
+    print("Benchmarking %s..." % name, end="", file=sys.stderr, flush=True)
+    samples = [runOnce(runner, cmd, inputPath) for _i in range(runs)]
+    wall = statistics.median([s["wall_sec"] for s in samples])
+    syscalls = countSyscalls(cmd, inputPath)
+    print(" %.3fs" % wall, file=sys.stderr)
+    return {
+        "name": name,
+        "command": cmd[1:],
+        "files": files,
+        "runs": samples,
+        "wall_sec_median": wall,
+        "wall_sec_min": min([s["wall_sec"] for s in samples]),
+        "files_per_sec": files / wall if wall > 0 else None,
+        "peak_rss_kb": max([s["peak_rss_kb"] for s in samples]),
+        "syscalls": syscalls,
+        "syscalls_per_file": syscalls / files if syscalls is not None and files > 0 else None,
+        "ok": all([s["exit_code"] == 0 for s in samples]),
+    }
+
+def writeServeScript(dirPath, name, lines):
+    path = os.path.join(dirPath, name)
+    with open(path, "w") as fout:
+        fout.write("\n".join(lines) + "\n")
+    return path
+
+def runBenchmarks(runner, workDir, manifest, args):
+    prog = "./%s" % A1_PROG
+    tree = manifest["tree"]
+    sample = manifest["sample"]
+    commands = args.commands.split(",")
+    threads = [int(t) for t in args.threads.split(",")]
+    results = []
+    if "list" in commands:
+        for t in threads:
+            results.append(benchmark(runner, "list/threads=%d" % t,
+                [prog, "list", "recursive", "threads=%d" % t, "path=%s" % tree],
+                manifest["entries"], args.runs))
+    if "parse" in commands and len(sample) > 0:
+        script = writeServeScript(workDir, "parse", ["parse path=%s" % f for f in sample])
+        results.append(benchmark(runner, "parse", [prog, "serve"], len(sample), args.runs, script))
+    if "extract" in commands and len(sample) > 0:
+        script = writeServeScript(workDir, "extract", ["extract path=%s section=1 line=1" % f for f in sample])
+        results.append(benchmark(runner, "extract", [prog, "serve"], len(sample), args.runs, script))
+    if "findall" in commands:
+        for io in args.io.split(","):
+            for t in threads:
+                cmd = [prog, "findall", "threads=%d" % t]
+                if io != "sync":
+                    cmd.append("io=%s" % io)
+                results.append(benchmark(runner, "findall/io=%s/threads=%d" % (io, t),
+                    cmd + ["path=%s" % tree], manifest["params"]["files"], args.runs))
+    return results
+
+def compareBaseline(results, baselinePath, tolerance):
+    with open(baselinePath) as fin:
+        baseline = {r["name"]: r for r in json.load(fin)["results"]}
+    regressions = []
+    for r in results:
+        old = baseline.get(r["name"])
+        if old is None or not old["files_per_sec"] or not r["files_per_sec"]:
+            continue
+        ratio = r["files_per_sec"] / old["files_per_sec"]
+        r["baseline_ratio"] = ratio
+        if ratio < 1.0 - tolerance:
+            regressions.append(r["name"])
+    return regressions
+
+def main():
+    parser = argparse.ArgumentParser(prog="bench.py",
+        description="Generates a reproducible SF corpus and times a1 list, parse, extract and findall on it.")
+    parser.add_argument("--root", default="bench_root",
+        help = "Directory holding the generated corpus (reused while the parameters match).")
+    parser.add_argument("--files", type=int, default=1000,
+        help = "Number of SF files to generate.")
+    parser.add_argument("--dirs", type=int,
+        help = "Number of directories (default: files / 10).")
+    parser.add_argument("--depth", type=int, default=8,
+        help = "Maximum directory depth.")
+    parser.add_argument("--sections", default="8:14",
+        help = "Section count range MIN:MAX for valid files.")
+    parser.add_argument("--corrupted", type=float, default=0.05,
+        help = "Fraction of files generated with a bad magic, version, section count or section type.")
+    parser.add_argument("--seed", default="75664",
+        help = "Random seed for the corpus.")
+    parser.add_argument("--regenerate", action="store_true",
+        help = "Rebuild the corpus even if it already matches.")
+    parser.add_argument("--commands", default="list,parse,extract,findall",
+        help = "Comma separated commands to benchmark.")
+    parser.add_argument("--threads", default="1,4",
+        help = "Comma separated thread counts for list and findall.")
+    parser.add_argument("--io", default="sync,uring",
+        help = "Comma separated findall I/O backends.")
+    parser.add_argument("--runs", type=int, default=3,
+        help = "Timed runs per benchmark; the median is reported.")
+    parser.add_argument("--cflags", default="-O2",
+        help = "Extra compiler flags for a1.")
+    parser.add_argument("-o", "--output",
+        help = "Write the JSON report here instead of stdout.")
+    parser.add_argument("-b", "--baseline",
+        help = "Previous JSON report to compare files/sec against.")
+    parser.add_argument("--tolerance", type=float, default=0.10,
+        help = "Allowed files/sec drop against the baseline before failing.")
+    args = parser.parse_args()
+
+    workDir = tempfile.mkdtemp(prefix="a1bench")
+    try:
+        runner = compile(args.cflags.split(), workDir)
+        manifest = buildCorpus(loadData(), args)
+        results = runBenchmarks(runner, workDir, manifest, args)
+    finally:
+        shutil.rmtree(workDir)
+    regressions = []
+    if args.baseline:
+        regressions = compareBaseline(results, args.baseline, args.tolerance)
+
+    report = {
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "host": os.uname().nodename,
+        "cpus": os.cpu_count(),
+        "cflags": args.cflags,
+        "corpus": {k: v for k, v in manifest.items() if k != "sample"},
+        "results": results,
+        "regressions": regressions,
+    }
+    if args.output:
+        with open(args.output, "w") as fout:
+            json.dump(report, fout, indent=4)
+    else:
+        json.dump(report, sys.stdout, indent=4)
+        print()
+    if len(regressions) > 0:
+        print("\033[1;31mRegressions: %s\033[0m" % ", ".join(regressions), file=sys.stderr)
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+# Checks that a corrupted SFHC header cache (cache=<file>) is treated as a
+# miss: parse must give the same output as without a cache, never crash.
+import os, sys, struct, subprocess, tempfile, shutil
+
+A1_PROG = "a1"
+TEST_FILES = ["example.sf"]
+
+CACHE_HEADER = struct.Struct("4siII")
+ENTRY_VERSION = 32
+ENTRY_SECTIONS = 36
+ENTRY_TABLE = 40
+SECTION_HEADER_SIZE = 19
+
+# (name, offset inside the entry, packed value)
+CORRUPTIONS = [
+    ("no_of_sections too large", ENTRY_SECTIONS, struct.pack("i", 100000)),
+    ("no_of_sections negative", ENTRY_SECTIONS, struct.pack("i", -5)),
+    ("no_of_sections not allowed", ENTRY_SECTIONS, struct.pack("i", 5)),
+    ("version too large", ENTRY_VERSION, struct.pack("i", 1000)),
+    ("version below errors", ENTRY_VERSION, struct.pack("i", -100)),
+    ("bad section type", ENTRY_TABLE + 7, struct.pack("i", 12345)),
+]
+
+def compile(workDir):
+    prog = os.path.join(workDir, A1_PROG)
+    res = subprocess.run(["gcc", "-Wall", "%s.c" % A1_PROG, "-o", prog, "-pthread"],
+                         stderr=subprocess.PIPE, text=True)
+    if res.returncode != 0:
+        print(res.stderr)
+        sys.exit(1)
+    return prog
+
+def parse(prog, path, cachePath=None):
+    cmd = [prog, "parse"]
+    if cachePath is not None:
+        cmd.append("cache=%s" % cachePath)
+    cmd.append("path=%s" % path)
+    res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    return res.returncode, res.stdout
+
+def occupiedEntries(cachePath):
+    data = open(cachePath, "rb").read()
+    magic, entrySize, capacity, _count = CACHE_HEADER.unpack_from(data)
+    if magic != b"SFHC":
+        return entrySize, []
+    offsets = []
+    for i in range(capacity):
+        off = CACHE_HEADER.size + i * entrySize
+        if struct.unpack_from("i", data, off + ENTRY_VERSION)[0] != 0:
+            offsets.append(off)
+    return entrySize, offsets
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a1_cache_test_")
+    failed = 0
+    try:
+        prog = compile(workDir)
+        for path in TEST_FILES:
+            expected = parse(prog, path)
+            cachePath = os.path.join(workDir, "headers.cache")
+            for name, offset, value in CORRUPTIONS:
+                if os.path.exists(cachePath):
+                    os.remove(cachePath)
+                parse(prog, path, cachePath)
+                _entrySize, entries = occupiedEntries(cachePath)
+                if len(entries) == 0:
+                    print("FAIL %s: cache file has no entry" % path)
+                    failed += 1
+                    break
+                with open(cachePath, "r+b") as f:
+                    for entry in entries:
+                        f.seek(entry + offset)
+                        f.write(value)
+                got = parse(prog, path, cachePath)
+                ok = got == expected
+                print("%s %s: %s" % ("ok  " if ok else "FAIL", path, name))
+                if not ok:
+                    print("\texpected rc=%d %r" % expected)
+                    print("\tgot      rc=%d %r" % got)
+                    failed += 1
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+# Checks that extract gives the same output with a line index (index, next
+# to the file as <path>.lidx, or index=DIR) as with a plain scan, for single
+# lines and for lines= batches, and that an index left over from an older
+# version of the file, or a damaged one, is rebuilt instead of used.
+import os, sys, random, subprocess, tempfile, shutil, json, base64
+
+import tester
+
+A1_PROG = "a1"
+NR_FILES = 20
+# generated files have at most 14 sections of at most 20 lines; go past
+# both ends of each
+MAX_SECTION = 15
+MAX_LINE = 22
+
+def compile(workDir):
+    prog = os.path.join(workDir, A1_PROG)
+    res = subprocess.run(["gcc", "-Wall", "%s.c" % A1_PROG, "-o", prog, "-pthread"],
+                         stderr=subprocess.PIPE, text=True)
+    if res.returncode != 0:
+        print(res.stderr)
+        sys.exit(1)
+    return prog
+
+def loadData():
+    with open("a1_data.json") as a1_data:
+        return json.loads(base64.b64decode(a1_data.read()).decode("utf-8"))
+
+def run(prog, *args):
+    res = subprocess.run([prog] + list(args), stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    return res.returncode, res.stdout
+
+def allLines():
+    return ",".join("%d:%d" % (s, l) for s in range(MAX_SECTION + 1) for l in range(MAX_LINE + 1))
+
+# The same lines asked for one by one and as a batch.
+def extractAll(prog, path, *options):
+    single = [run(prog, "extract", *options, "section=%d" % s, "line=%d" % l, "path=%s" % path)
+              for s, l in [(1, 1), (2, 3), (MAX_SECTION, 1), (1, MAX_LINE)]]
+    return single, run(prog, "extract", *options, "lines=%s" % allLines(), "path=%s" % path)
+
+def compare(name, expected, got):
+    ok = got == expected
+    print("%s %s" % ("ok  " if ok else "FAIL", name))
+    if not ok:
+        print("\texpected %r" % (expected,))
+        print("\tgot      %r" % (got,))
+    return 0 if ok else 1
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a1_line_index_test_")
+    failed = 0
+    try:
+        prog = compile(workDir)
+        data = loadData()
+        random.seed(75664)
+        filesDir = os.path.join(workDir, "files")
+        indexDir = os.path.join(workDir, "index")
+        os.mkdir(filesDir)
+        os.mkdir(indexDir)
+        paths = []
+        for i in range(NR_FILES):
+            path = os.path.join(filesDir, "f%d.sf" % i)
+            tester.genSectionFile(path.encode(), data)
+            paths.append(path)
+
+        for path in paths:
+            name = os.path.basename(path)
+            scan = extractAll(prog, path)
+            failed += compare("%s: index next to the file" % name, scan, extractAll(prog, path, "index"))
+            failed += compare("%s: %s.lidx written" % (name, name), True, os.path.exists(path + ".lidx"))
+            failed += compare("%s: sidecar index reused" % name, scan, extractAll(prog, path, "index"))
+            failed += compare("%s: index=DIR" % name, scan, extractAll(prog, path, "index=%s" % indexDir))
+
+        # index=DIR names its files after device and inode, one per file
+        failed += compare("index=DIR holds one index per file", NR_FILES, len(os.listdir(indexDir)))
+        path = paths[0]
+        rc, out = run(prog, "index", "index=%s" % indexDir, "path=%s" % path)
+        lines = out.decode().split("\n")
+        failed += compare("index command names the index it wrote", (0, "SUCCESS", True),
+                          (rc, lines[0], len(lines) > 1 and os.path.dirname(lines[1]) == indexDir and os.path.exists(lines[1])))
+        failed += compare("unwritable index=DIR falls back to the scan", extractAll(prog, path),
+                          extractAll(prog, path, "index=%s" % os.path.join(workDir, "missing")))
+
+        # same size, different lines: a newline turned into a letter
+        for where, options in (("sidecar", ["index"]), ("index=DIR", ["index=%s" % indexDir])):
+            extractAll(prog, path, *options)
+            content = bytearray(open(path, "rb").read())
+            content[content.index(b"\n")] = ord("x")
+            st = os.stat(path)
+            with open(path, "r+b") as f:
+                f.write(content)
+            # a rewrite within one timestamp tick is out of reach of a
+            # stat-based check; make sure the mtime moves
+            os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns + 1000000000))
+            failed += compare("stale %s index rebuilt after the file changed" % where,
+                              extractAll(prog, path), extractAll(prog, path, *options))
+
+        # a rewritten file that is a different size
+        tester.genSectionFile(path.encode(), data)
+        failed += compare("stale index rebuilt after the file was regenerated",
+                          extractAll(prog, path), extractAll(prog, path, "index"))
+
+        # damaged sidecars: cut short, then grown past the recorded counts
+        for name, damage in (("truncated", lambda b: b[:len(b) // 2]), ("extended", lambda b: b + b"\0" * 8)):
+            index = open(path + ".lidx", "rb").read()
+            with open(path + ".lidx", "wb") as f:
+                f.write(damage(index))
+            failed += compare("%s index rebuilt" % name, extractAll(prog, path), extractAll(prog, path, "index"))
+            failed += compare("%s index replaced on disk" % name, index, open(path + ".lidx", "rb").read())
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
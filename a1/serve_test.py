@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Checks that a1 serve answers every command with the same output as a
+# one-shot run of the same arguments, including paths with spaces, quotes
+# and backslashes (escaped or quoted on the serve line), files changing
+# between requests, and that malformed or over-long lines get an error
+# frame instead of being cut short.
+import os, sys, random, subprocess, tempfile, shutil, json, base64
+
+import tester
+
+A1_PROG = "a1"
+SERVE_MAX_ARGS = 64
+TIME_LIMIT = 60
+
+def compile(workDir):
+    prog = os.path.join(workDir, A1_PROG)
+    res = subprocess.run(["gcc", "-Wall", "%s.c" % A1_PROG, "-o", prog, "-pthread"],
+                         stderr=subprocess.PIPE, text=True)
+    if res.returncode != 0:
+        print(res.stderr)
+        sys.exit(1)
+    return prog
+
+def loadData():
+    with open("a1_data.json") as a1_data:
+        return json.loads(base64.b64decode(a1_data.read()).decode("utf-8"))
+
+def oneShot(prog, args):
+    return subprocess.run([prog] + args, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                          timeout=TIME_LIMIT).stdout
+
+# The two ways a serve line can carry a word with blanks in it.
+def escaped(word):
+    return "".join("\\" + c if c in " \t\"\\" else c for c in word)
+
+def quoted(word):
+    return '"%s"' % word.replace("\\", "\\\\").replace('"', '\\"')
+
+class Server:
+    def __init__(self, prog, *options):
+        self.proc = subprocess.Popen([prog, "serve"] + list(options), stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+
+    def send(self, line):
+        self.proc.stdin.write(line.encode() + b"\n")
+        self.proc.stdin.flush()
+
+    def frame(self):
+        size = self.proc.stdout.readline()
+        if not size.endswith(b"\n"):
+            return None
+        return self.proc.stdout.read(int(size))
+
+    def request(self, args, quote=escaped):
+        self.send(" ".join(quote(a) for a in args))
+        return self.frame()
+
+    def close(self):
+        self.proc.stdin.close()
+        rc = self.proc.wait(timeout=TIME_LIMIT)
+        self.proc.stdout.close()
+        return rc
+
+def report(ok, name, details=None):
+    print("%s %s" % ("ok  " if ok else "FAIL", name))
+    if not ok and details:
+        print("\t%s" % details)
+    return 0 if ok else 1
+
+# Several threads print in no fixed order; compare those as sets of lines.
+def unordered(out):
+    lines = out.split(b"\n")
+    return lines[:1] + sorted(lines[1:])
+
+def commands(tree, indexDir):
+    files = sorted(os.path.join(d, f) for d, _dirs, names in os.walk(tree) for f in names)
+    cmds = [
+        ["variant"],
+        ["list", "path=%s" % tree],
+        ["list", "recursive", "path=%s" % tree],
+        ["list", "recursive", "size_greater=13000", "path=%s" % tree],
+        ["list", "recursive", "name_ends_with= name.sf", "path=%s" % tree],
+        ["findall", "path=%s" % tree],
+        ["parse", "path=%s" % os.path.join(tree, "no such file")],
+        ["extract", "path=%s" % os.path.join(tree, "no such file"), "section=1", "line=1"],
+        ["extract", "section=1", "line=1"],
+        ["nonsense", "path=%s" % tree],
+    ]
+    for path in files:
+        cmds.append(["parse", "path=%s" % path])
+        cmds.append(["extract", "section=1", "line=1", "path=%s" % path])
+        cmds.append(["extract", "lines=1:1,2:2,3:5,1:40,0:1", "path=%s" % path])
+        cmds.append(["extract", "index=%s" % indexDir, "lines=2:1,1:3", "path=%s" % path])
+    return cmds
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a1_serve_test_")
+    failed = 0
+    try:
+        prog = compile(workDir)
+        data = loadData()
+        random.seed(75664)
+        tree = os.path.join(workDir, "tree with space")
+        shutil.copytree("test_root", tree)
+        for name in ('a "quoted" name.sf', "back\\slash name.sf", "tab\tname.sf"):
+            shutil.copy("example.sf", os.path.join(tree, name))
+        indexDir = os.path.join(workDir, "index dir")
+        os.mkdir(indexDir)
+
+        cmds = commands(tree, indexDir)
+        expected = [oneShot(prog, args) for args in cmds]
+        server = Server(prog)
+        # twice, so the second pass goes through the open-file and header caches
+        for rnd in range(2):
+            got = [server.request(args, quoted if i % 2 else escaped) for i, args in enumerate(cmds)]
+            bad = [i for i in range(len(cmds)) if got[i] != expected[i]]
+            failed += report(len(bad) == 0, "%d commands match one-shot runs, pass %d" % (len(cmds), rnd + 1),
+                             bad and "%d differ, first %s: expected %r, got %r" % (len(bad), cmds[bad[0]], expected[bad[0]], got[bad[0]]))
+            for args in (["list", "recursive", "threads=4", "path=%s" % tree], ["findall", "threads=4", "path=%s" % tree]):
+                failed += report(unordered(server.request(args)) == unordered(oneShot(prog, args)),
+                                 "%s threads=4 matches a one-shot run, pass %d" % (args[0], rnd + 1))
+
+        # a file replaced between two requests
+        path = os.path.join(tree, "changing.sf")
+        shutil.copy("example.sf", path)
+        before = server.request(["extract", "lines=1:1,1:2", "path=%s" % path])
+        tester.genSectionFile(path.encode(), data)
+        after = server.request(["extract", "lines=1:1,1:2", "path=%s" % path])
+        failed += report(before != after and after == oneShot(prog, ["extract", "lines=1:1,1:2", "path=%s" % path]),
+                         "a file rewritten between requests is read again")
+
+        # the most words a line may have, and one more
+        filler = ["x%d" % i for i in range(SERVE_MAX_ARGS - 3)]
+        longest = ["parse"] + filler + ["path=%s" % path]
+        failed += report(server.request(longest) == oneShot(prog, longest), "%d words are accepted" % len(longest))
+        failed += report(server.request(["parse"] + filler + ["x", "path=%s" % path]) == b"ERROR\ntoo many arguments\n",
+                         "%d words are rejected" % (len(longest) + 1))
+        for line, error in (('parse "path=%s' % path, b"ERROR\nunterminated quote\n"),
+                            ("parse path=%s\\" % path, b"ERROR\ntrailing backslash\n")):
+            server.send(line)
+            failed += report(server.frame() == error, "%r is rejected" % error.split(b"\n")[1].decode())
+        failed += report(server.request(["serve"]) == b"ERROR\ninvalid arguments\n", "serve does not nest")
+        # blank lines get no frame at all
+        server.send("")
+        server.send(" \t ")
+        failed += report(server.request(["variant"]) == oneShot(prog, ["variant"]), "blank lines are skipped")
+        server.send("quit")
+        failed += report(server.frame() is None and server.close() == 0, "quit ends the session")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# Checks that findall io=uring finds the same files as the synchronous
+# scan, and still does when io_uring is unavailable: a small runner makes
+# io_uring_setup, io_uring_register or io_uring_enter fail with ENOSYS
+# (seccomp) before exec'ing a1, covering a failed setup, a failed probe and
+# a ring that breaks in the middle of a scan.
+import os, sys, random, subprocess, tempfile, shutil, json, base64
+
+import tester
+
+A1_PROG = "a1"
+RUNNER_PROG = "no_uring"
+TIME_LIMIT = 60
+SYS_IO_URING_SETUP = 425
+
+# no_uring SYSCALL COMMAND [ARGS...]: runs COMMAND with SYSCALL (setup,
+# register or enter) failing with ENOSYS.
+RUNNER_SRC = r"""
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+int main(int argc, char **argv){
+    int nr = strcmp(argv[1], "setup") == 0 ? __NR_io_uring_setup :
+             strcmp(argv[1], "register") == 0 ? __NR_io_uring_register : __NR_io_uring_enter;
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nr, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {sizeof(filter) / sizeof(filter[0]), filter};
+    if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0){
+        perror("seccomp");
+        return 126;
+    }
+    execvp(argv[2], argv + 2);
+    _exit(127);
+}
+"""
+
+def compile(workDir):
+    progs = {}
+    runnerSrc = os.path.join(workDir, "%s.c" % RUNNER_PROG)
+    with open(runnerSrc, "w") as f:
+        f.write(RUNNER_SRC)
+    for name, src, flags in [(A1_PROG, "%s.c" % A1_PROG, ["-pthread"]), (RUNNER_PROG, runnerSrc, [])]:
+        prog = os.path.join(workDir, name)
+        res = subprocess.run(["gcc", "-Wall", src, "-o", prog] + flags, stderr=subprocess.PIPE, text=True)
+        if res.returncode != 0 or "warning" in res.stderr:
+            print(res.stderr)
+            sys.exit(1)
+        progs[name] = prog
+    return progs
+
+def loadData():
+    with open("a1_data.json") as a1_data:
+        return json.loads(base64.b64decode(a1_data.read()).decode("utf-8"))
+
+# More files than the ring holds, so submissions are batched and reaped
+# while the walk goes on, plus every kind of file findall has to skip.
+def buildTree(data, root):
+    dirs = tester.makeRandomDirs(root.encode(), 100)
+    tester.makeRandomFiles(data, 1500, dirs)
+    tester.makeCorruptedFiles(data, root.encode())
+    tester.makeHugeFiles(data, root.encode())
+    open(os.path.join(root, "empty"), "w").close()
+    with open(os.path.join(root, "short"), "wb") as f:
+        f.write(b"Nn")
+    os.symlink("empty", os.path.join(root, "link"))
+    os.mkfifo(os.path.join(root, "fifo"))
+
+def findall(cmd):
+    res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=TIME_LIMIT)
+    lines = res.stdout.decode().split("\n")
+    # several threads, or the ring's completion order, print in no fixed order
+    return res.returncode, lines[:1], sorted(lines[1:])
+
+def report(ok, name, details=None):
+    print("%s %s" % ("ok  " if ok else "FAIL", name))
+    if not ok and details:
+        print("\t%s" % details)
+    return 0 if ok else 1
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a1_uring_test_")
+    failed = 0
+    try:
+        progs = compile(workDir)
+        data = loadData()
+        random.seed(75664)
+        root = os.path.join(workDir, "tree")
+        buildTree(data, root)
+        prog = progs[A1_PROG]
+        cachePath = os.path.join(workDir, "headers.cache")
+
+        # the fallback checks below mean nothing if the filter lets the call through
+        probe = "import ctypes; print(ctypes.CDLL(None).syscall(%d, 4, ctypes.create_string_buffer(120)))"
+        blocked = subprocess.run([progs[RUNNER_PROG], "setup", sys.executable, "-c", probe % SYS_IO_URING_SETUP],
+                                 stdout=subprocess.PIPE, text=True).stdout.strip()
+        failed += report(blocked == "-1", "the runner makes io_uring_setup fail", blocked)
+
+        expected = findall([prog, "findall", "path=%s" % root])
+        failed += report(expected[1] == ["SUCCESS"] and len(expected[2]) > 100, "sync findall finds files",
+                         "%s, %d lines" % (expected[1], len(expected[2])))
+        for threads in (1, 4):
+            base = ["findall", "io=uring", "threads=%d" % threads]
+            failed += report(findall([prog] + base + ["path=%s" % root]) == expected,
+                             "io=uring threads=%d matches sync" % threads)
+            for cache in ("cold", "warm"):
+                if cache == "cold" and os.path.exists(cachePath):
+                    os.remove(cachePath)
+                failed += report(findall([prog] + base + ["cache=%s" % cachePath, "path=%s" % root]) == expected,
+                                 "io=uring threads=%d with a %s cache matches sync" % (threads, cache))
+            for syscall in ("setup", "register", "enter"):
+                failed += report(findall([progs[RUNNER_PROG], syscall, prog] + base + ["path=%s" % root]) == expected,
+                                 "io=uring threads=%d without io_uring_%s falls back to sync" % (threads, syscall))
+        failed += report(findall([prog, "findall", "io=uring", "path=%s" % os.path.join(root, "missing")]) ==
+                         findall([prog, "findall", "path=%s" % os.path.join(root, "missing")]),
+                         "io=uring on a missing path fails like sync")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
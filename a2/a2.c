@@ -1,36 +1,42 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sys/mman.h>
 #include "a2_helper.h"
-#include <fcntl.h>
+#include "a2_sync.h"
 
 #define NO_THREADS_P7 4
 #define NO_THREADS_P5 35
 #define NO_MAX_THREADS 4
 #define NO_THREADS_P4 6
+#define P5_STACK_SIZE (64 * 1024)
 
 typedef struct{
     int id;
-    sem_t* sem_P7T2;
-    sem_t* sem_P7T3;
+    sync_event_t* T2_started;
+    sync_event_t* T3_ended;
 }TH_STRUCT_P7;
 
 typedef struct{
     int id;
-    sem_t* sem_limit;
-    sem_t* semT14;
-    sem_t* sem_barrier;
-    sem_t* sem_equal4;
-    sem_t* sem_cnt;
-    int* running_threads;
+    sync_sem_t* limit;
+    sync_event_t* T14_started;
+    sync_latch_t* four_running;
+    sync_event_t* T14_ended;
+    sync_latch_t* done;
 }TH_STRUCT_P5;
 
-sem_t* sem_P4T2;
-sem_t* sem_P7T4;
+// ordering edges between P4 and P7, in memory shared by the whole tree
+typedef struct{
+    sync_event_t P4T2_ended;
+    sync_event_t P7T4_ended;
+}SHARED_EVENTS;
+
+SHARED_EVENTS* shared;
 
 void* th_func_P7(void* arg){
     TH_STRUCT_P7* data = (TH_STRUCT_P7*)arg;
@@ -38,21 +44,21 @@ void* th_func_P7(void* arg){
 
     if(id == 2){
         info(BEGIN, 7, id);
-        sem_post(data->sem_P7T2);
-        sem_wait(data->sem_P7T3);
+        sync_event_set(data->T2_started);
+        sync_event_wait(data->T3_ended);
         info(END, 7, id);
     }
     else if(id == 3){
-        sem_wait(data->sem_P7T2);
+        sync_event_wait(data->T2_started);
         info(BEGIN, 7, id);
         info(END, 7, id);
-        sem_post(data->sem_P7T3);
+        sync_event_set(data->T3_ended);
     }
     else if(id == 4){
-        sem_wait(sem_P4T2);
+        sync_event_wait(&shared->P4T2_ended);
         info(BEGIN, 7, id);
         info(END, 7, id);
-        sem_post(sem_P7T4);
+        sync_event_set(&shared->P7T4_ended);
     } 
     else{
         info(BEGIN, 7, id);
@@ -66,36 +72,27 @@ void* th_func_P5(void* arg){
     TH_STRUCT_P5* data = (TH_STRUCT_P5*)arg;
     int id = data->id;
 
-    if(id != 14){
-        sem_wait(data->semT14);
-        sem_post(data->semT14);
-    }
-
-    sem_wait(data->sem_limit);
+    // T14 is started first and ends while the first NO_MAX_THREADS threads,
+    // itself included, are all running; the others hold their END until then.
+    // The thread was started holding a slot of 'limit'.
     info(BEGIN, 5, id);
-
-    sem_wait(data->sem_cnt);
-    (*data->running_threads)++;
-    if(*data->running_threads == 4){
-        sem_post(data->sem_equal4);
-    }
-    sem_post(data->sem_cnt);
+    sync_latch_count_down(data->four_running);
 
     if(id == 14){
-        sem_post(data->semT14);
-        sem_wait(data->sem_equal4);
+        sync_event_set(data->T14_started);
+        sync_latch_wait(data->four_running);
     } else {
-        sem_wait(data->sem_barrier);
-        sem_post(data->sem_barrier);
+        sync_event_wait(data->T14_ended);
     }
 
     info(END, 5, id);
 
     if(id == 14){
-        sem_post(data->sem_barrier);
+        sync_event_set(data->T14_ended);
     }
 
-    sem_post(data->sem_limit);
+    sync_sem_post(data->limit);
+    sync_latch_count_down(data->done);
     return NULL;
 }
 
@@ -103,25 +100,357 @@ void* th_func_P4(void* arg){
     int* id = (int*)arg;
 
     if (*id == 4) {
-        sem_wait(sem_P7T4);
+        sync_event_wait(&shared->P7T4_ended);
     }
 
     info(BEGIN, 4, *id);
     info(END, 4, *id);
 
     if (*id == 2) {
-        sem_post(sem_P4T2);
+        sync_event_set(&shared->P4T2_ended);
+    }
+
+    return NULL;
+}
+
+
+// Declarative mode (A2_DATA=<path to a2_data.json>): the process tree,
+// thread counts and ordering rules are read from the assignment data
+// instead of being hard-coded above. Ordering rules between threads become
+// edges "event X of thread A happens before event Y of thread B", each one
+// a process-shared sync_event_t that A sets right after its info() call and
+// B waits for right before its own. The "at most N threads, the waiter
+// ends while N run" rule is kept as a per-process group.
+#define MAX_PROCS 64
+#define MAX_EDGES 16
+#define MAX_DATA_SIZE 65536
+#define RUNNER_STACK_SIZE (64 * 1024)
+
+typedef struct{
+    int from_proc, from_thread, from_action;
+    int to_proc, to_thread, to_action;
+    sync_event_t done;
+}EDGE;
+
+typedef struct{
+    int nprocs;
+    int parent[MAX_PROCS + 1];
+    int threads[MAX_PROCS + 1];
+    int group_proc;
+    int group_max;
+    int group_waiter;
+    int nedges;
+    EDGE edges[MAX_EDGES];
+}SCENARIO;
+
+typedef struct{
+    int waiter;
+    sync_sem_t limit;
+    sync_event_t waiter_started;
+    sync_latch_t running;
+    sync_event_t waiter_ended;
+}GROUP;
+
+typedef struct{
+    int proc;
+    int id;
+    SCENARIO* scenario;
+    GROUP* group;
+}TH_STRUCT_RUNNER;
+
+static int base64_decode(const char* in, char* out, int out_size){
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int bits = 0;
+    int nbits = 0, len = 0;
+
+    for(; *in != 0 && *in != '='; in++){
+        const char* p = strchr(alphabet, *in);
+        if(p == NULL){
+            continue;
+        }
+        bits = (bits << 6) | (p - alphabet);
+        nbits += 6;
+        if(nbits >= 8){
+            nbits -= 8;
+            if(len == out_size - 1){
+                return -1;
+            }
+            out[len++] = (bits >> nbits) & 0xff;
+        }
+    }
+    out[len] = 0;
+    return len;
+}
+
+// Reads the string value that follows p (spaces, ':' and spaces, "value").
+static const char* json_value(const char* p, char* out, int out_size){
+    int len = 0;
+
+    while(*p == ' ' || *p == ':' || *p == '\n' || *p == '\t'){
+        p++;
+    }
+    if(*p != '"'){
+        return NULL;
+    }
+    for(p++; *p != 0 && *p != '"'; p++){
+        if(*p == '\\' && p[1] != 0){
+            p++;
+        }
+        if(len < out_size - 1){
+            out[len++] = *p;
+        }
+    }
+    out[len] = 0;
+    return *p == '"' ? p + 1 : NULL;
+}
+
+static int json_int(const char* json, const char* key){
+    char pattern[64], value[32];
+    const char* p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if((p = strstr(json, pattern)) == NULL || json_value(p + strlen(pattern), value, sizeof(value)) == NULL){
+        return -1;
+    }
+    return atoi(value);
+}
+
+static void add_edge(SCENARIO* sc, int from_proc, int from_thread, int from_action, int to_proc, int to_thread, int to_action){
+    EDGE* edge;
+
+    if(sc->nedges == MAX_EDGES || from_proc < 1 || to_proc < 1){
+        return;
+    }
+    edge = &sc->edges[sc->nedges++];
+    edge->from_proc = from_proc;
+    edge->from_thread = from_thread;
+    edge->from_action = from_action;
+    edge->to_proc = to_proc;
+    edge->to_thread = to_thread;
+    edge->to_action = to_action;
+    sync_event_init(&edge->done, 1);
+}
+
+static int load_scenario(const char* path, SCENARIO* sc){
+    static char encoded[MAX_DATA_SIZE], json[MAX_DATA_SIZE];
+    char key[16], value[16];
+    const char* p;
+    FILE* f;
+    size_t n;
+
+    if((f = fopen(path, "r")) == NULL){
+        perror(path);
+        return -1;
+    }
+    n = fread(encoded, 1, sizeof(encoded) - 1, f);
+    fclose(f);
+    encoded[n] = 0;
+    if(base64_decode(encoded, json, sizeof(json)) < 0 || (p = strstr(json, "\"procs\"")) == NULL || (p = strchr(p, '{')) == NULL){
+        fprintf(stderr, "%s: unexpected format\n", path);
+        return -1;
+    }
+
+    memset(sc, 0, sizeof(*sc));
+    for(p++; *p != 0 && *p != '}'; ){
+        if(*p != '"'){
+            p++;
+            continue;
+        }
+        if((p = json_value(p, key, sizeof(key))) == NULL || (p = json_value(p, value, sizeof(value))) == NULL){
+            break;
+        }
+        int proc = atoi(key);
+        if(proc >= 1 && proc <= MAX_PROCS){
+            sc->parent[proc] = atoi(value);
+            if(proc > sc->nprocs){
+                sc->nprocs = proc;
+            }
+        }
+    }
+
+    int p1 = json_int(json, "threads1_proc");
+    int p2 = json_int(json, "threads2_proc");
+    int p3 = json_int(json, "threads3_proc");
+    if(p1 >= 1 && p1 <= sc->nprocs){
+        sc->threads[p1] = json_int(json, "threads1_count");
+    }
+    if(p2 >= 1 && p2 <= sc->nprocs){
+        sc->threads[p2] = json_int(json, "threads2_count");
+        sc->group_proc = p2;
+        sc->group_max = json_int(json, "threads2_max");
+        sc->group_waiter = json_int(json, "threads2_waiter");
+    }
+    if(p3 >= 1 && p3 <= sc->nprocs){
+        sc->threads[p3] = json_int(json, "threads3_count");
     }
 
+    // threads1: outer/inner pair inside one process; threads1_3 is the
+    // thread of that process ordered against two threads of threads3
+    int outer = json_int(json, "threads1_outer");
+    int inner = json_int(json, "threads1_inner");
+    add_edge(sc, p1, outer, BEGIN, p1, inner, BEGIN);
+    add_edge(sc, p1, inner, END, p1, outer, END);
+
+    int t1 = json_int(json, "threads1_3");
+    add_edge(sc, p3, json_int(json, "threads3_before"), END, p1, t1, BEGIN);
+    add_edge(sc, p1, t1, END, p3, json_int(json, "threads3_after"), BEGIN);
+    return 0;
+}
+
+static void wait_edges(SCENARIO* sc, int proc, int thread, int action){
+    for(int i = 0; i < sc->nedges; i++){
+        EDGE* edge = &sc->edges[i];
+        if(edge->to_proc == proc && edge->to_thread == thread && edge->to_action == action){
+            sync_event_wait(&edge->done);
+        }
+    }
+}
+
+static void set_edges(SCENARIO* sc, int proc, int thread, int action){
+    for(int i = 0; i < sc->nedges; i++){
+        EDGE* edge = &sc->edges[i];
+        if(edge->from_proc == proc && edge->from_thread == thread && edge->from_action == action){
+            sync_event_set(&edge->done);
+        }
+    }
+}
+
+void* th_func_runner(void* arg){
+    TH_STRUCT_RUNNER* data = (TH_STRUCT_RUNNER*)arg;
+    SCENARIO* sc = data->scenario;
+    GROUP* group = data->group;
+    int id = data->id;
+    int waiter = group != NULL && id == group->waiter;
+
+    if(group != NULL && group->waiter != 0 && !waiter){
+        sync_event_wait(&group->waiter_started);
+    }
+    wait_edges(sc, data->proc, id, BEGIN);
+    if(group != NULL){
+        sync_sem_wait(&group->limit);
+    }
+    info(BEGIN, data->proc, id);
+    set_edges(sc, data->proc, id, BEGIN);
+
+    if(group != NULL){
+        sync_latch_count_down(&group->running);
+        if(waiter){
+            sync_event_set(&group->waiter_started);
+            sync_latch_wait(&group->running);
+        } else if(group->waiter != 0){
+            sync_event_wait(&group->waiter_ended);
+        }
+    }
+
+    wait_edges(sc, data->proc, id, END);
+    info(END, data->proc, id);
+    set_edges(sc, data->proc, id, END);
+
+    if(group != NULL){
+        if(waiter){
+            sync_event_set(&group->waiter_ended);
+        }
+        sync_sem_post(&group->limit);
+    }
     return NULL;
 }
 
+static void run_threads(SCENARIO* sc, int proc){
+    int count = sc->threads[proc];
+    pthread_t* threads;
+    TH_STRUCT_RUNNER* data;
+    pthread_attr_t attr;
+    GROUP group;
+
+    if(count <= 0){
+        return;
+    }
+    threads = malloc(count * sizeof(pthread_t));
+    data = malloc(count * sizeof(TH_STRUCT_RUNNER));
+    if(threads == NULL || data == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    if(proc == sc->group_proc){
+        int max = sc->group_max > 0 ? sc->group_max : count;
+        group.waiter = sc->group_waiter >= 1 && sc->group_waiter <= count ? sc->group_waiter : 0;
+        sync_sem_init(&group.limit, 0, max);
+        sync_event_init(&group.waiter_started, 0);
+        sync_latch_init(&group.running, 0, max < count ? max : count);
+        sync_event_init(&group.waiter_ended, 0);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RUNNER_STACK_SIZE);
+    for(int i = 0; i < count; i++){
+        data[i].proc = proc;
+        data[i].id = i + 1;
+        data[i].scenario = sc;
+        data[i].group = proc == sc->group_proc ? &group : NULL;
+        pthread_create(&threads[i], &attr, th_func_runner, &data[i]);
+    }
+    for(int i = 0; i < count; i++){
+        pthread_join(threads[i], NULL);
+    }
+    pthread_attr_destroy(&attr);
+    free(threads);
+    free(data);
+}
+
+// Children are forked right after BEGIN, so the whole tree comes up at
+// once and every process runs its threads in parallel with the others.
+static void run_process(SCENARIO* sc, int proc){
+    info(BEGIN, proc, 0);
+    for(int child = 1; child <= sc->nprocs; child++){
+        if(sc->parent[child] == proc && fork() == 0){
+            run_process(sc, child);
+            exit(0);
+        }
+    }
+    run_threads(sc, proc);
+    while(wait(NULL) > 0);
+    info(END, proc, 0);
+}
+
+static int run_scenario(const char* path){
+    SCENARIO* sc = mmap(NULL, sizeof(SCENARIO), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int root = 0;
+
+    if(sc == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    if(load_scenario(path, sc) != 0){
+        munmap(sc, sizeof(SCENARIO));
+        return 1;
+    }
+    for(int proc = 1; proc <= sc->nprocs && root == 0; proc++){
+        if(sc->parent[proc] == 0){
+            root = proc;
+        }
+    }
+    if(root != 0){
+        run_process(sc, root);
+    }
+    munmap(sc, sizeof(SCENARIO));
+    return 0;
+}
 
 int main(){
     init();
 
-    sem_P4T2 = sem_open("P4T2", O_CREAT, 0644, 0);
-    sem_P7T4 = sem_open("P7T4", O_CREAT, 0644, 0);
+    char* data_path = getenv("A2_DATA");
+    if(data_path != NULL){
+        return run_scenario(data_path);
+    }
+
+    shared = mmap(NULL, sizeof(SHARED_EVENTS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    sync_event_init(&shared->P4T2_ended, 1);
+    sync_event_init(&shared->P7T4_ended, 1);
 
     info(BEGIN, 1, 0); // P1
     
@@ -169,40 +498,48 @@ int main(){
 
     if(fork() == 0){ // P5
         info(BEGIN, 5, 0);
-        pthread_t threads[NO_THREADS_P5];
+        pthread_t thread;
+        pthread_attr_t attr;
         TH_STRUCT_P5 data[NO_THREADS_P5];
 
-        sem_t sem_limit, sem_barrier, sem_cnt, sem_equal4, semT14;
+        sync_sem_t limit;
+        sync_event_t T14_started, T14_ended;
+        sync_latch_t four_running, done;
 
-        sem_init(&sem_limit, 0, NO_MAX_THREADS);
-        sem_init(&sem_barrier, 0, 0);
-        sem_init(&sem_cnt, 0, 1);
-        sem_init(&sem_equal4, 0, 0);
-        sem_init(&semT14, 0, 0);
+        sync_sem_init(&limit, 0, NO_MAX_THREADS);
+        sync_event_init(&T14_started, 0);
+        sync_event_init(&T14_ended, 0);
+        sync_latch_init(&four_running, 0, NO_MAX_THREADS);
+        sync_latch_init(&done, 0, NO_THREADS_P5);
 
-        int running_threads = 0;
+        // Threads are only created when a slot of 'limit' is free, so at
+        // most NO_MAX_THREADS of them exist at a time instead of one per
+        // task. info() allows a single BEGIN/END per thread, so each task
+        // still needs a thread of its own.
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&attr, P5_STACK_SIZE);
 
         for(int i = 0; i < NO_THREADS_P5; i++){
-            data[i].id = i + 1;
-            data[i].sem_limit = &sem_limit;
-            data[i].sem_barrier = &sem_barrier;
-            data[i].sem_cnt = &sem_cnt;
-            data[i].sem_equal4 = &sem_equal4;
-            data[i].semT14 = &semT14;
-            data[i].running_threads = &running_threads;
-
-            pthread_create(&threads[i], NULL, th_func_P5, &data[i]);
-        }
-
-        for(int i = 0; i < NO_THREADS_P5; i++){
-            pthread_join(threads[i], NULL);
+            // T14 first, then the others in order
+            int id = i == 0 ? 14 : (i < 14 ? i : i + 1);
+
+            data[i].id = id;
+            data[i].limit = &limit;
+            data[i].T14_started = &T14_started;
+            data[i].four_running = &four_running;
+            data[i].T14_ended = &T14_ended;
+            data[i].done = &done;
+
+            sync_sem_wait(&limit);
+            pthread_create(&thread, &attr, th_func_P5, &data[i]);
+            if(id == 14){
+                sync_event_wait(&T14_started);
+            }
         }
 
-        sem_destroy(&sem_limit);
-        sem_destroy(&sem_barrier);
-        sem_destroy(&sem_cnt);
-        sem_destroy(&sem_equal4);
-        sem_destroy(&semT14);
+        sync_latch_wait(&done);
+        pthread_attr_destroy(&attr);
 
         info(END, 5, 0);
         exit(0);
@@ -213,15 +550,15 @@ int main(){
         pthread_t threads[NO_THREADS_P7];
         TH_STRUCT_P7 data[NO_THREADS_P7];
 
-        sem_t sem_P7T2, sem_P7T3;
+        sync_event_t T2_started, T3_ended;
 
-        sem_init(&sem_P7T2, 0, 0);
-        sem_init(&sem_P7T3, 0, 0);
+        sync_event_init(&T2_started, 0);
+        sync_event_init(&T3_ended, 0);
 
         for(int i = 0; i < NO_THREADS_P7; i++){
             data[i].id = i + 1;
-            data[i].sem_P7T3 = &sem_P7T3;
-            data[i].sem_P7T2 = &sem_P7T2;
+            data[i].T2_started = &T2_started;
+            data[i].T3_ended = &T3_ended;
             pthread_create(&threads[i], NULL, th_func_P7, &data[i]);
         }
 
@@ -229,9 +566,6 @@ int main(){
             pthread_join(threads[i], NULL);
         }
 
-        sem_destroy(&sem_P7T3);
-        sem_destroy(&sem_P7T2);
-
         info(END, 7, 0);
         exit(0);
     }
@@ -247,8 +581,7 @@ int main(){
     wait(NULL);
     wait(NULL);
 
-    sem_unlink("P4T2");
-    sem_unlink("P7T4");
+    munmap(shared, sizeof(SHARED_EVENTS));
 
     info(END, 1, 0);
     return 0;
@@ -0,0 +1,262 @@
+// Local collector for the A2_HELPER_COLLECTOR channel of a2_helper.c.
+//
+//     a2_collector SOCKET LOG COMMAND [ARGS...]
+//
+// Listens on the Unix socket SOCKET and runs COMMAND with
+// A2_HELPER_COLLECTOR pointing at it. Every process of the tree then
+// streams its events over its own connection. Once COMMAND has exited and
+// every connection is closed, the collector checks that each process sent
+// a gapless sequence and writes all events to LOG in time order, one per
+// line:
+//
+//     BEGIN P<process> T<thread> pid=<pid> ppid=<ppid> tid=<tid>
+//
+// The exit status is COMMAND's, or 2 if an event is missing or garbled.
+//
+//     gcc -Wall a2_collector.c -o a2_collector
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "a2_helper.h"
+#include "a2_collector.h"
+
+#define POLL_MS 100
+#define CONN_BUF_EVENTS 64
+
+struct conn {
+    int fd;
+    size_t have;
+    char buf[CONN_BUF_EVENTS * sizeof(struct collector_event)];
+};
+
+static struct conn **conns = NULL;
+static int nconns = 0;
+static struct collector_event *events = NULL;
+static int nevents = 0;
+static int capacity = 0;
+static int errors = 0;
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int add_event(const struct collector_event *event)
+{
+    if(nevents == capacity) {
+        int newCapacity = capacity > 0 ? 2 * capacity : 1024;
+        struct collector_event *newEvents = realloc(events, newCapacity * sizeof(*events));
+        if(newEvents == NULL) {
+            return -1;
+        }
+        events = newEvents;
+        capacity = newCapacity;
+    }
+    events[nevents++] = *event;
+    return 0;
+}
+
+static void accept_all(int listener)
+{
+    int fd;
+
+    while((fd = accept(listener, NULL, NULL)) >= 0) {
+        // every connection is read on each pass, so none may block
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct conn **newConns = realloc(conns, (nconns + 1) * sizeof(*conns));
+        struct conn *conn = calloc(1, sizeof(*conn));
+        if(newConns == NULL || conn == NULL) {
+            perror("could not accept a connection");
+            free(conn);
+            close(fd);
+            errors++;
+            if(newConns != NULL) {
+                conns = newConns;
+            }
+            continue;
+        }
+        conn->fd = fd;
+        conns = newConns;
+        conns[nconns++] = conn;
+    }
+}
+
+// Reads what the connection has; returns 0 once it is closed.
+static int read_conn(struct conn *conn)
+{
+    ssize_t n = read(conn->fd, conn->buf + conn->have, sizeof(conn->buf) - conn->have);
+    size_t used = 0;
+
+    if(n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if(n <= 0) {
+        if(conn->have != 0) {
+            fprintf(stderr, "a connection closed in the middle of an event\n");
+            errors++;
+        }
+        return 0;
+    }
+    conn->have += n;
+    while(conn->have - used >= sizeof(struct collector_event)) {
+        struct collector_event event;
+        memcpy(&event, conn->buf + used, sizeof(event));
+        if(add_event(&event) != 0) {
+            perror("could not store an event");
+            errors++;
+        }
+        used += sizeof(event);
+    }
+    memmove(conn->buf, conn->buf + used, conn->have - used);
+    conn->have -= used;
+    return 1;
+}
+
+static int cmp_by_process(const void *a, const void *b)
+{
+    const struct collector_event *ea = a;
+    const struct collector_event *eb = b;
+
+    if(ea->pid != eb->pid) {
+        return ea->pid < eb->pid ? -1 : 1;
+    }
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int cmp_by_time(const void *a, const void *b)
+{
+    const struct collector_event *ea = a;
+    const struct collector_event *eb = b;
+
+    if(ea->ns != eb->ns) {
+        return ea->ns < eb->ns ? -1 : 1;
+    }
+    return cmp_by_process(a, b);
+}
+
+// Every process numbers its events 0, 1, 2, ... in the order info() was
+// called; a hole or a repeat means an event was lost or sent twice.
+static void check_sequences()
+{
+    qsort(events, nevents, sizeof(*events), cmp_by_process);
+    for(int i = 0; i < nevents; i++) {
+        int expected = i > 0 && events[i - 1].pid == events[i].pid ? events[i - 1].seq + 1 : 0;
+        if(events[i].seq != expected) {
+            fprintf(stderr, "pid %d: event %d received, expected %d\n", events[i].pid, events[i].seq, expected);
+            errors++;
+        }
+    }
+}
+
+static int write_log(const char *path)
+{
+    FILE *log = fopen(path, "w");
+
+    if(log == NULL) {
+        perror("could not open the log");
+        return -1;
+    }
+    qsort(events, nevents, sizeof(*events), cmp_by_time);
+    for(int i = 0; i < nevents; i++) {
+        const struct collector_event *event = &events[i];
+        fprintf(log, "%s P%d T%d pid=%d ppid=%d tid=%d\n", event->action==BEGIN?"BEGIN":"END",
+            event->processNr, event->threadNr, event->pid, event->ppid, event->tid);
+    }
+    return fclose(log);
+}
+
+int main(int argc, char **argv)
+{
+    int listener;
+    int status = 0;
+    int childDone = 0;
+    pid_t child;
+
+    if(argc < 4) {
+        fprintf(stderr, "usage: %s SOCKET LOG COMMAND [ARGS...]\n", argv[0]);
+        return 1;
+    }
+    if((listener = listen_on(argv[1])) < 0) {
+        perror("could not listen on the collector socket");
+        return 1;
+    }
+    if((child = fork()) < 0) {
+        perror("fork");
+        return 1;
+    }
+    if(child == 0) {
+        setenv(COLLECTOR_ENV, argv[1], 1);
+        execvp(argv[3], argv + 3);
+        perror("exec");
+        _exit(127);
+    }
+
+    // Runs until the command has exited and the last process of its tree
+    // has closed its connection.
+    while(!childDone || nconns > 0) {
+        struct pollfd *fds = calloc(nconns + 1, sizeof(*fds));
+        if(fds == NULL) {
+            perror("poll set");
+            return 1;
+        }
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for(int i = 0; i < nconns; i++) {
+            fds[i + 1].fd = conns[i]->fd;
+            fds[i + 1].events = POLLIN;
+        }
+        poll(fds, nconns + 1, POLL_MS);
+        free(fds);
+
+        accept_all(listener);
+        for(int i = 0; i < nconns; i++) {
+            if(!read_conn(conns[i])) {
+                close(conns[i]->fd);
+                free(conns[i]);
+                conns[i--] = conns[--nconns];
+            }
+        }
+        if(!childDone && waitpid(child, &status, WNOHANG) == child) {
+            childDone = 1;
+            // a process that connected just before the end is still queued
+            accept_all(listener);
+        }
+    }
+    close(listener);
+    unlink(argv[1]);
+
+    check_sequences();
+    if(write_log(argv[2]) != 0) {
+        errors++;
+    }
+    free(events);
+    free(conns);
+    if(errors > 0) {
+        return 2;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
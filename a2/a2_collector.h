@@ -0,0 +1,25 @@
+#ifndef __A2_COLLECTOR_H__
+#define __A2_COLLECTOR_H__
+
+// Wire format of the A2_HELPER_COLLECTOR channel. Every process keeps one
+// Unix socket connection to the collector and streams these records over
+// it, with no reply. 'seq' numbers the events of one process from 0 in the
+// order info() was called, so the collector can tell a lost event from a
+// late one. 'ns' is CLOCK_MONOTONIC taken at the same moment and orders
+// the events of different processes.
+
+#define COLLECTOR_ENV "A2_HELPER_COLLECTOR"
+
+struct collector_event {
+    long long ns;
+    int seq;
+    int action;
+    int processNr;
+    int threadNr;
+    int pid;
+    int ppid;
+    int tid;
+    int reserved;
+};
+
+#endif
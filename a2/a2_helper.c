@@ -5,17 +5,24 @@
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <semaphore.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include <time.h>
 
 #include "a2_helper.h"
+#include "a2_collector.h"
 
 #define SEM_NAME "A2_HELPER_SEM_17871"
 #define SERVER_PORT 1988
+#define TRACE_ENV "A2_HELPER_TRACE"
+#define TRACE_SLOTS 1024
+#define TRACE_SLOT_EVENTS 4
 
 #define XSTR(s) STR(s)
 #define STR(s) #s
@@ -24,6 +31,69 @@
 static int initialized = 0;
 static pthread_key_t helper_key_state;
 static pthread_key_t helper_key_thread_nr;
+static sem_t *helper_sem = SEM_FAILED;
+
+// When A2_HELPER_COLLECTOR names a Unix socket (see a2_collector.c),
+// info() only appends the event to a per-process queue. A sender thread,
+// started on the first event of each process, drains the queue in batches
+// over one persistent connection and prints every event once it knows the
+// outcome: "[T]" when it was written to the collector and "[ ]" when it
+// could not be. The collector does not reply, so there is no sleep time.
+// The test server on port 1988 accepts a single message per connection,
+// assigns times in arrival order and answers with a delay for the calling
+// thread, so it is always reached the old, synchronous way.
+struct collector_queue {
+    struct collector_event *events;
+    int count;
+    int capacity;
+};
+
+static const char *collector_path = NULL;
+static int collector_fd = -1;
+static pthread_mutex_t collector_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t collector_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t collector_idle = PTHREAD_COND_INITIALIZER;
+static struct collector_queue collector_pending;
+static struct collector_queue collector_batch;
+static int collector_sending = 0;
+static int collector_started = 0;
+static int collector_seq = 0;
+
+// When A2_HELPER_TRACE is set, every info() call is also recorded in a log
+// shared by all processes: a MAP_SHARED region mapped by init(), so every
+// forked process sees it. Each thread claims its own slot with one atomic
+// increment and then appends to it without any lock. When the process that
+// called init() exits, the slots are merged by timestamp into <prefix>.txt
+// and a Chrome trace in <prefix>.json.
+struct trace_event {
+    long long ns;
+    int action;
+};
+
+struct trace_slot {
+    int processNr;
+    int threadNr;
+    int pid;
+    int tid;
+    int count;
+    struct trace_event events[TRACE_SLOT_EVENTS];
+};
+
+struct trace_log {
+    int next_slot;
+    int dropped;
+    struct trace_slot slots[TRACE_SLOTS];
+};
+
+struct trace_record {
+    const struct trace_slot *slot;
+    const struct trace_event *event;
+};
+
+static const char *trace_prefix = NULL;
+static struct trace_log *trace_log = NULL;
+static pid_t trace_owner = 0;
+static __thread struct trace_slot *trace_slot = NULL;
 
 enum {
     INFO_STATE_BEFORE_BEGIN = 0,
@@ -31,6 +101,254 @@ enum {
     INFO_STATE_AFTER_END
 };
 
+static void trace_record_event(int action, int processNr, int threadNr)
+{
+    struct timespec ts;
+    struct trace_slot *slot = trace_slot;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if(slot == NULL) {
+        int idx = __atomic_fetch_add(&trace_log->next_slot, 1, __ATOMIC_RELAXED);
+        if(idx >= TRACE_SLOTS) {
+            __atomic_fetch_add(&trace_log->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        slot = trace_slot = &trace_log->slots[idx];
+        slot->processNr = processNr;
+        slot->threadNr = threadNr;
+        slot->pid = getpid();
+        slot->tid = (int)(long)pthread_self();
+    }
+    if(slot->count == TRACE_SLOT_EVENTS) {
+        __atomic_fetch_add(&trace_log->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slot->events[slot->count].ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    slot->events[slot->count].action = action;
+    // the merger only reads events below the published count
+    __atomic_store_n(&slot->count, slot->count + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_record_cmp(const void *a, const void *b)
+{
+    const struct trace_record *ra = a;
+    const struct trace_record *rb = b;
+
+    if(ra->event->ns != rb->event->ns) {
+        return ra->event->ns < rb->event->ns ? -1 : 1;
+    }
+    return ra->slot < rb->slot ? -1 : ra->slot > rb->slot;
+}
+
+static void trace_dump()
+{
+    struct trace_record *records = NULL;
+    char path[4096];
+    FILE *txt = NULL;
+    FILE *json = NULL;
+    int nslots = 0;
+    int nrecords = 0;
+    long long start = 0;
+
+    if(trace_log == NULL || getpid() != trace_owner) {
+        return;
+    }
+    do {
+        nslots = __atomic_load_n(&trace_log->next_slot, __ATOMIC_ACQUIRE);
+        if(nslots > TRACE_SLOTS) {
+            nslots = TRACE_SLOTS;
+        }
+        CHECK((records = malloc(sizeof(*records) * (nslots * TRACE_SLOT_EVENTS + 1))) != NULL);
+        for(int i = 0; i < nslots; i++) {
+            const struct trace_slot *slot = &trace_log->slots[i];
+            int count = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+            for(int j = 0; j < count; j++) {
+                records[nrecords].slot = slot;
+                records[nrecords].event = &slot->events[j];
+                nrecords++;
+            }
+        }
+        qsort(records, nrecords, sizeof(*records), trace_record_cmp);
+        if(nrecords > 0) {
+            start = records[0].event->ns;
+        }
+
+        snprintf(path, sizeof(path), "%s.txt", trace_prefix);
+        CHECK((txt = fopen(path, "w")) != NULL);
+        snprintf(path, sizeof(path), "%s.json", trace_prefix);
+        CHECK((json = fopen(path, "w")) != NULL);
+        fprintf(json, "{\"traceEvents\": [");
+        for(int i = 0; i < nrecords; i++) {
+            const struct trace_slot *slot = records[i].slot;
+            const struct trace_event *event = records[i].event;
+            double us = (event->ns - start) / 1000.0;
+
+            fprintf(txt, "%12.3f %s P%d T%d pid=%d tid=%d\n", us, event->action==BEGIN?"BEGIN":" END ",
+                slot->processNr, slot->threadNr, slot->pid, slot->tid);
+            fprintf(json, "%s\n{\"name\": \"P%d T%d\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d}",
+                i == 0 ? "" : ",", slot->processNr, slot->threadNr, event->action==BEGIN?"B":"E", us,
+                slot->processNr, slot->threadNr);
+        }
+        fprintf(json, "\n], \"displayTimeUnit\": \"ns\"}\n");
+        if(trace_log->dropped > 0) {
+            fprintf(txt, "# %d event(s) dropped\n", trace_log->dropped);
+        }
+    } while(0);
+    if(txt != NULL) {
+        fclose(txt);
+    }
+    if(json != NULL) {
+        fclose(json);
+    }
+    free(records);
+}
+
+static int collector_connect()
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    do {
+        CHECK((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, collector_path, sizeof(addr.sun_path) - 1);
+        if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) >= 0) {
+            return fd;
+        }
+    } while(0);
+    if(fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+static void collector_print(const struct collector_event *event, int sent)
+{
+    printf("%s %s P%d T%d pid=%d ppid=%d tid=%d\n", sent ? "[T]" : "[ ]", event->action==BEGIN?"BEGIN":" END ",
+        event->processNr, event->threadNr, event->pid, event->ppid, event->tid);
+}
+
+// Writes the batch and returns how many events made it out whole.
+static int collector_send(const struct collector_event *events, int count)
+{
+    const char *buf = (const char*)events;
+    size_t len = count * sizeof(*events);
+    size_t done = 0;
+
+    if(collector_fd < 0) {
+        collector_fd = collector_connect();
+    }
+    while(collector_fd >= 0 && done < len) {
+        ssize_t n = send(collector_fd, buf + done, len - done, MSG_NOSIGNAL);
+        if(n <= 0) {
+            perror("info function failed to reach the collector");
+            close(collector_fd);
+            collector_fd = -1;
+            break;
+        }
+        done += n;
+    }
+    return done / sizeof(*events);
+}
+
+static void* collector_run(void *arg)
+{
+    struct collector_queue batch;
+    int sent;
+
+    pthread_mutex_lock(&collector_lock);
+    for(;;) {
+        while(collector_pending.count == 0) {
+            pthread_cond_wait(&collector_wakeup, &collector_lock);
+        }
+        // take everything queued so far; info() keeps appending meanwhile
+        batch = collector_pending;
+        collector_pending = collector_batch;
+        collector_batch = batch;
+        collector_sending = 1;
+        pthread_mutex_unlock(&collector_lock);
+
+        sent = collector_send(batch.events, batch.count);
+        for(int i = 0; i < batch.count; i++) {
+            collector_print(&batch.events[i], i < sent);
+        }
+
+        pthread_mutex_lock(&collector_lock);
+        collector_batch.count = 0;
+        collector_sending = 0;
+        pthread_cond_broadcast(&collector_idle);
+    }
+    return NULL;
+}
+
+// Called with collector_lock held.
+static int collector_enqueue(const struct collector_event *event)
+{
+    struct collector_queue *queue = &collector_pending;
+
+    if(!collector_started) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, collector_run, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(thread);
+        collector_started = 1;
+    }
+    if(queue->count == queue->capacity) {
+        int capacity = queue->capacity > 0 ? 2 * queue->capacity : 64;
+        struct collector_event *events = realloc(queue->events, capacity * sizeof(*events));
+        if(events == NULL) {
+            return -1;
+        }
+        queue->events = events;
+        queue->capacity = capacity;
+    }
+    queue->events[queue->count++] = *event;
+    pthread_cond_signal(&collector_wakeup);
+    return 0;
+}
+
+static int collector_info(int msg[6])
+{
+    struct collector_event event;
+    struct timespec ts;
+    int err = -1;
+
+    memset(&event, 0, sizeof(event));
+    event.action = msg[0];
+    event.processNr = msg[1];
+    event.threadNr = msg[2];
+    event.pid = msg[3];
+    event.ppid = msg[4];
+    event.tid = msg[5];
+    do {
+        CHECK(pthread_mutex_lock(&collector_lock) == 0);
+        // stamped under the lock, so seq and ns agree within a process
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        event.ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        event.seq = collector_seq++;
+        err = collector_enqueue(&event);
+        pthread_mutex_unlock(&collector_lock);
+        if(err != 0) {
+            perror("info function could not queue the event");
+            collector_print(&event, 0);
+        }
+    } while(0);
+    return err;
+}
+
+// Runs at exit in every process: waits until the sender has handled all
+// queued events, so none is lost when the process ends.
+static void collector_flush()
+{
+    pthread_mutex_lock(&collector_lock);
+    while(collector_started && (collector_pending.count > 0 || collector_sending)) {
+        pthread_cond_wait(&collector_idle, &collector_lock);
+    }
+    pthread_mutex_unlock(&collector_lock);
+}
+
 int info(int action, int processNr, int threadNr)
 {
     int msg[6];
@@ -80,18 +398,25 @@ int info(int action, int processNr, int threadNr)
     if(err < 0) {
         return err;
     }
-    err = -1;
-    do {
-        CHECK((sem = sem_open(SEM_NAME, 0)) != SEM_FAILED);
+    if(trace_log != NULL) {
+        trace_record_event(action, processNr, threadNr);
+    }
 
-        //prepare the message
-        msg[0] = action;
-        msg[1] = processNr;
-        msg[2] = threadNr;
-        msg[3] = getpid();
-        msg[4] = getppid();
-        msg[5] = (int)(long)pthread_self();
+    //prepare the message
+    msg[0] = action;
+    msg[1] = processNr;
+    msg[2] = threadNr;
+    msg[3] = getpid();
+    msg[4] = getppid();
+    msg[5] = (int)(long)pthread_self();
 
+    if(collector_path != NULL) {
+        return collector_info(msg);
+    }
+
+    err = -1;
+    do {
+        CHECK((sem = helper_sem) != SEM_FAILED);
         CHECK((sockfd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
         
         memset(&serv_addr, 0, sizeof(serv_addr));
@@ -124,24 +449,40 @@ int info(int action, int processNr, int threadNr)
 
 void atfork_prepare()
 {
-    sem_t *sem = SEM_FAILED;
     do {
-        CHECK((sem = sem_open(SEM_NAME, O_CREAT, 0644, 1)) != SEM_FAILED);
-        CHECK(sem_wait(sem) == 0);
+        CHECK(helper_sem != SEM_FAILED);
+        CHECK(sem_wait(helper_sem) == 0);
     } while(0);
+    pthread_mutex_lock(&collector_lock);
 }
 
 void atfork_parent()
 {
-    sem_t *sem = SEM_FAILED;
+    pthread_mutex_unlock(&collector_lock);
     do {
-        CHECK((sem = sem_open(SEM_NAME, O_CREAT, 0644, 1)) != SEM_FAILED);
-        CHECK(sem_post(sem) == 0);
+        CHECK(helper_sem != SEM_FAILED);
+        CHECK(sem_post(helper_sem) == 0);
     } while(0);
 }
 
 void atfork_child()
 {
+    // the forking thread gets a new trace slot in the child
+    trace_slot = NULL;
+    // the child opens its own connection to the collector and starts its
+    // own sender; events still queued belong to the parent, which sends them
+    if(collector_fd >= 0) {
+        close(collector_fd);
+        collector_fd = -1;
+    }
+    collector_pending.count = 0;
+    collector_batch.count = 0;
+    collector_sending = 0;
+    collector_started = 0;
+    collector_seq = 0;
+    pthread_cond_init(&collector_wakeup, NULL);
+    pthread_cond_init(&collector_idle, NULL);
+    pthread_mutex_unlock(&collector_lock);
     prctl(PR_SET_PDEATHSIG, SIGHUP);
     pthread_key_create(&helper_key_state, NULL);
     pthread_key_create(&helper_key_thread_nr, NULL);
@@ -158,6 +499,20 @@ void init()
         pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
         sem_unlink(SEM_NAME);
         CHECK((sem = sem_open(SEM_NAME, O_CREAT, 0644, 1)) != SEM_FAILED);
+        helper_sem = sem;
+        if((collector_path = getenv(COLLECTOR_ENV)) != NULL) {
+            atexit(collector_flush);
+        }
+        if((trace_prefix = getenv(TRACE_ENV)) != NULL) {
+            trace_log = mmap(NULL, sizeof(*trace_log), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if(trace_log == MAP_FAILED) {
+                perror("could not map the trace log");
+                trace_log = NULL;
+            } else {
+                trace_owner = getpid();
+                atexit(trace_dump);
+            }
+        }
         CHECK(pthread_key_create(&helper_key_state, NULL) == 0);
         CHECK(pthread_key_create(&helper_key_thread_nr, NULL) == 0);
         initialized = 1;
@@ -0,0 +1,163 @@
+#ifndef __A2_SYNC_H__
+#define __A2_SYNC_H__
+
+// Futex-based synchronization primitives. Every operation first tries a
+// single atomic on the shared word and only enters the kernel when it has
+// to sleep or when somebody is known to be sleeping. Objects placed in
+// memory shared between processes (MAP_SHARED) must be initialized with
+// pshared = 1, like sem_init().
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void sync_futex_wait(int *addr, int val, int pshared){
+    syscall(SYS_futex, addr, pshared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void sync_futex_wake(int *addr, int count, int pshared){
+    syscall(SYS_futex, addr, pshared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Counting semaphore, used as a gate that lets at most 'value' holders in.
+typedef struct{
+    int value;
+    int waiters;
+    int pshared;
+}sync_sem_t;
+
+static inline void sync_sem_init(sync_sem_t* sem, int pshared, int value){
+    sem->value = value;
+    sem->waiters = 0;
+    sem->pshared = pshared;
+}
+
+static inline void sync_sem_wait(sync_sem_t* sem){
+    for(;;){
+        int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+        while(value > 0){
+            if(__atomic_compare_exchange_n(&sem->value, &value, value - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+                return;
+            }
+        }
+        __atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&sem->value, __ATOMIC_SEQ_CST) == 0){
+            sync_futex_wait(&sem->value, 0, sem->pshared);
+        }
+        __atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void sync_sem_post(sync_sem_t* sem){
+    __atomic_fetch_add(&sem->value, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0){
+        sync_futex_wake(&sem->value, 1, sem->pshared);
+    }
+}
+
+// One-shot event: once set, every current and future waiter goes through.
+// This is the "A happens before B" edge between threads or processes.
+enum{
+    SYNC_EVENT_CLEAR = 0,
+    SYNC_EVENT_WAITED,
+    SYNC_EVENT_SET
+};
+
+typedef struct{
+    int state;
+    int pshared;
+}sync_event_t;
+
+static inline void sync_event_init(sync_event_t* event, int pshared){
+    event->state = SYNC_EVENT_CLEAR;
+    event->pshared = pshared;
+}
+
+static inline void sync_event_wait(sync_event_t* event){
+    int state = __atomic_load_n(&event->state, __ATOMIC_ACQUIRE);
+
+    while(state != SYNC_EVENT_SET){
+        if(state == SYNC_EVENT_WAITED ||
+           __atomic_compare_exchange_n(&event->state, &state, SYNC_EVENT_WAITED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+            sync_futex_wait(&event->state, SYNC_EVENT_WAITED, event->pshared);
+        }
+        state = __atomic_load_n(&event->state, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void sync_event_set(sync_event_t* event){
+    if(__atomic_exchange_n(&event->state, SYNC_EVENT_SET, __ATOMIC_RELEASE) == SYNC_EVENT_WAITED){
+        sync_futex_wake(&event->state, INT_MAX, event->pshared);
+    }
+}
+
+// Countdown latch: waiters are released once count_down() has been called
+// 'count' times. Extra count_down() calls are ignored.
+typedef struct{
+    int count;
+    int waiters;
+    int pshared;
+}sync_latch_t;
+
+static inline void sync_latch_init(sync_latch_t* latch, int pshared, int count){
+    latch->count = count;
+    latch->waiters = 0;
+    latch->pshared = pshared;
+}
+
+static inline void sync_latch_count_down(sync_latch_t* latch){
+    int count = __atomic_load_n(&latch->count, __ATOMIC_RELAXED);
+
+    while(count > 0){
+        if(__atomic_compare_exchange_n(&latch->count, &count, count - 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+            if(count == 1 && __atomic_load_n(&latch->waiters, __ATOMIC_SEQ_CST) > 0){
+                sync_futex_wake(&latch->count, INT_MAX, latch->pshared);
+            }
+            return;
+        }
+    }
+}
+
+static inline void sync_latch_wait(sync_latch_t* latch){
+    int count;
+
+    while((count = __atomic_load_n(&latch->count, __ATOMIC_ACQUIRE)) > 0){
+        __atomic_fetch_add(&latch->waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&latch->count, __ATOMIC_SEQ_CST) == count){
+            sync_futex_wait(&latch->count, count, latch->pshared);
+        }
+        __atomic_fetch_sub(&latch->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Reusable barrier for a fixed number of participants.
+typedef struct{
+    int parties;
+    int arrived;
+    int generation;
+    int pshared;
+}sync_barrier_t;
+
+static inline void sync_barrier_init(sync_barrier_t* barrier, int pshared, int parties){
+    barrier->parties = parties;
+    barrier->arrived = 0;
+    barrier->generation = 0;
+    barrier->pshared = pshared;
+}
+
+static inline void sync_barrier_wait(sync_barrier_t* barrier){
+    int generation = __atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE);
+
+    if(__atomic_add_fetch(&barrier->arrived, 1, __ATOMIC_ACQ_REL) == barrier->parties){
+        __atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&barrier->generation, 1, __ATOMIC_RELEASE);
+        sync_futex_wake(&barrier->generation, INT_MAX, barrier->pshared);
+        return;
+    }
+    while(__atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE) == generation){
+        sync_futex_wait(&barrier->generation, generation, barrier->pshared);
+    }
+}
+
+#endif
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# Runs a2 against the local collector (A2_HELPER_COLLECTOR, a2_collector.c)
+# and checks the collected, time-ordered events with the same checks the
+# tester applies to its TCP server. Also checks that with no collector to
+# reach, every event is still printed, marked "[ ]".
+import os, sys, re, json, base64, signal, subprocess, tempfile, shutil, types
+
+import tester
+
+A2_PROG = "a2"
+COLLECTOR_PROG = "a2_collector"
+TIME_LIMIT = 10
+
+EVENT_RE = re.compile(r"^(\[[T ]\])\s+(BEGIN|END)\s+P(\d+) T(\d+) pid=(-?\d+) ppid=(-?\d+) tid=(-?\d+)$")
+LOG_RE = re.compile(r"^(BEGIN|END) P(\d+) T(\d+) pid=(-?\d+) ppid=(-?\d+) tid=(-?\d+)$")
+
+def compile(workDir):
+    progs = {}
+    for name, cmd in [
+        (A2_PROG, ["gcc", "-Wall", "%s.c" % A2_PROG, "%s_helper.c" % A2_PROG, "-pthread", "-lrt"]),
+        (COLLECTOR_PROG, ["gcc", "-Wall", "%s.c" % COLLECTOR_PROG]),
+    ]:
+        prog = os.path.join(workDir, name)
+        res = subprocess.run(cmd + ["-o", prog], stderr=subprocess.PIPE, text=True)
+        if res.returncode != 0 or "warning" in res.stderr:
+            print(res.stderr)
+            sys.exit(1)
+        progs[name] = prog
+    return progs
+
+def loadData():
+    with open("a2_data.json") as a2_data:
+        return json.loads(base64.b64decode(a2_data.read()).decode("utf-8"))
+
+# Runs cmd in its own process group, so a hung process tree can be killed
+# as a whole. Returns (exit code, stdout, stderr); the code is None on timeout.
+def run(cmd, cwd, env=None):
+    p = subprocess.Popen(cmd, cwd=cwd, env=env, start_new_session=True,
+                         stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    try:
+        out, err = p.communicate(timeout=TIME_LIMIT)
+        return p.returncode, out, err
+    except subprocess.TimeoutExpired:
+        os.killpg(p.pid, signal.SIGKILL)
+        out, err = p.communicate()
+        return None, out, err
+
+def printedEvents(stdout):
+    # a2's own stdout buffer can be copied into a child at fork, so the
+    # same line may show up twice; a set is what is compared
+    events = set()
+    marks = set()
+    for line in stdout.splitlines():
+        m = EVENT_RE.match(line)
+        if m is not None:
+            marks.add(m.group(1))
+            events.add((m.group(2), int(m.group(3)), int(m.group(4))))
+    return events, marks
+
+def checkCollected(data, logPath):
+    server = types.SimpleNamespace()
+    tester.Server.reset(server)
+    events = set()
+    with open(logPath) as log:
+        for line in log:
+            m = LOG_RE.match(line.strip())
+            if m is None:
+                return ["bad log line %r" % line], events
+            action = tester.Info.BEGIN if m.group(1) == "BEGIN" else tester.Info.END
+            msg = (action,) + tuple(int(g) for g in m.groups()[1:])
+            tester.Server.addInfo(server, msg)
+            events.add((m.group(1), msg[1], msg[2]))
+    errors = list(server.errors)
+    for checkFn, checkName in tester.Tester.CHECK_FUNCTIONS:
+        checkErrors, score = checkFn(data, server.infos)
+        if score != tester.Tester.CHECK_MAX_SCORE:
+            errors.append("%s: %d / %d %s" % (checkName, score, tester.Tester.CHECK_MAX_SCORE, checkErrors))
+    return errors, events
+
+def report(ok, name, details=None):
+    print("%s %s" % ("ok  " if ok else "FAIL", name))
+    if not ok and details:
+        print("\t%s" % details)
+    return 0 if ok else 1
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a2_collector_test_")
+    failed = 0
+    try:
+        progs = compile(workDir)
+        data = loadData()
+        sock = os.path.join(workDir, "collector.sock")
+        logPath = os.path.join(workDir, "events.log")
+
+        rc, out, err = run([progs[COLLECTOR_PROG], sock, logPath, progs[A2_PROG]], workDir)
+        if rc is None:
+            report(False, "a2 under the collector exits cleanly", "timed out")
+            sys.exit(1)
+        failed += report(rc == 0, "a2 under the collector exits cleanly", "rc=%d %s" % (rc, err.strip()))
+        printed, marks = printedEvents(out)
+        failed += report(marks == {"[T]"}, "every event is reported as sent", "marks %s" % sorted(marks))
+        errors, collected = checkCollected(data, logPath)
+        failed += report(len(errors) == 0, "collected order passes the tester checks", "; ".join(errors))
+        failed += report(len(collected) > 0 and collected == printed, "collector got every printed event",
+                         "only printed: %s, only collected: %s" % (sorted(printed - collected), sorted(collected - printed)))
+
+        # nobody listening: the events are printed as not sent, not lost
+        env = dict(os.environ, A2_HELPER_COLLECTOR=os.path.join(workDir, "missing.sock"))
+        rc, out, _err = run([progs[A2_PROG]], workDir, env)
+        unsent, marks = printedEvents(out)
+        failed += report(rc == 0 and marks == {"[ ]"} and unsent == printed,
+                         "without a collector every event is printed as not sent",
+                         "rc=%s marks %s, missing %s" % (rc, sorted(marks), sorted(printed - unsent)))
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -1,210 +1,1654 @@
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define RESP_PIPE "RESP_PIPE_75664"
 #define REQ_PIPE "REQ_PIPE_75664"
+#define SHM_NAME "/yTJuDV"
+#define SHARE_SOCK "SHARE_SOCK_75664"
+#define RING_SHM "/yTJuDV_ring"
+#define RING_DEFAULT_SIZE (64 * 1024)
+#define RING_MAX_SIZE (16 * 1024 * 1024)
+#define RING_DATA_OFFSET 4096
+#define RING_SPIN 4000
+#define RING_WAIT_MS 100
+#define REQ_BUF_SIZE 65536
+#define MAX_STRING 250
+#define MAX_ARGS 3
+#define RESP_IOV_MAX 256
+#define RESP_DATA_SIZE 1024
+#define NT_COPY_THRESHOLD (256 * 1024)
+#define READ_MULTI_FIELDS 5
+#define READ_MULTI_MAX 1024
+#define READ_MULTI_PARALLEL (4 * 1024 * 1024)
+#define READ_MULTI_THREADS 4
+#define MAX_SESSIONS 64
+#define MAX_WORKERS 16
+#define NAME_SIZE 64
+#define FILE_CACHE_BUCKETS 256
+#define FILE_CACHE_FILES 64
+#define FILE_CACHE_MB 1024
+#define SF_MAGIC "Nn1J"
+#define SECTION_HEADER_SIZE 19
+#define LOGICAL_ALIGNMENT 3072
+
+#define RESPOND(writer, str) writer_add(writer, str, strlen(str))
 
 const unsigned int VERSION = 75664;
 
-int main(){
+enum{
+    CMD_UNKNOWN,
+    CMD_PING,
+    CMD_CREATE_SHM,
+    CMD_WRITE_TO_SHM,
+    CMD_MAP_FILE,
+    CMD_READ_FROM_FILE_OFFSET,
+    CMD_READ_FROM_FILE_SECTION,
+    CMD_READ_FROM_LOGICAL_SPACE_OFFSET,
+    CMD_SHARE_FILE,
+    CMD_LOCATE_FILE_SECTION,
+    CMD_LOCATE_LOGICAL_SPACE_OFFSET,
+    CMD_RING_CONNECT,
+    CMD_OPEN_SESSION,
+    CMD_READ_MULTI,
+    CMD_EXIT
+};
 
-    if(mkfifo(RESP_PIPE, 0644) != 0){
-        perror("ERROR\ncannot create the response pipe\n");
-        return 1;
+struct command{
+    const char *name;
+    int id;
+    int nargs;
+    int has_path;
+    int vec_fields;
+};
+
+static const struct command commands[] = {
+    {"PING", CMD_PING, 0, 0, 0},
+    {"CREATE_SHM", CMD_CREATE_SHM, 1, 0, 0},
+    {"WRITE_TO_SHM", CMD_WRITE_TO_SHM, 2, 0, 0},
+    {"MAP_FILE", CMD_MAP_FILE, 0, 1, 0},
+    {"READ_FROM_FILE_OFFSET", CMD_READ_FROM_FILE_OFFSET, 2, 0, 0},
+    {"READ_FROM_FILE_SECTION", CMD_READ_FROM_FILE_SECTION, 3, 0, 0},
+    {"READ_FROM_LOGICAL_SPACE_OFFSET", CMD_READ_FROM_LOGICAL_SPACE_OFFSET, 2, 0, 0},
+    {"SHARE_FILE", CMD_SHARE_FILE, 0, 0, 0},
+    {"LOCATE_FILE_SECTION", CMD_LOCATE_FILE_SECTION, 3, 0, 0},
+    {"LOCATE_LOGICAL_SPACE_OFFSET", CMD_LOCATE_LOGICAL_SPACE_OFFSET, 2, 0, 0},
+    {"RING_CONNECT", CMD_RING_CONNECT, 1, 0, 0},
+    {"OPEN_SESSION", CMD_OPEN_SESSION, 0, 0, 0},
+    {"READ_MULTI", CMD_READ_MULTI, 1, 0, READ_MULTI_FIELDS},
+    {"EXIT", CMD_EXIT, 0, 0, 0},
+};
+
+// Commands with vec_fields take a count as their last argument, followed by
+// that many records of vec_fields numbers. 'vec' points at the records in
+// the reader buffer and is only valid until the next read_request(); it is
+// NULL when the count is over READ_MULTI_MAX, in which case the records are
+// skipped so the next request can still be read.
+struct request{
+    int cmd;
+    unsigned int args[MAX_ARGS];
+    char path[MAX_STRING];
+    const unsigned char *vec;
+};
+
+// Shared-memory transport negotiated with RING_CONNECT. RING_SHM holds two
+// single-producer/single-consumer byte rings carrying exactly the bytes the
+// pipes would: requests (client -> server) and responses (server -> client).
+//
+//   offset 0:    unsigned int size (bytes per ring, a power of two)
+//   offset 64:   request ring control, offset 192: response ring control
+//   offset 4096: request ring data, followed by the response ring data
+//
+// head and tail are free-running byte counters. The producer stores the
+// data, then publishes tail with release semantics; the consumer reads tail
+// with acquire semantics, consumes and publishes head. A side that finds
+// its ring empty (or full) spins briefly, then sets the matching *_waiters
+// word and sleeps in FUTEX_WAIT on tail (or head); the other side issues a
+// FUTEX_WAKE after publishing whenever that word is set.
+struct ring_ctl{
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned int tail_waiters;
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int head_waiters;
+};
+
+struct ring{
+    struct ring_ctl *ctl;
+    char *data;
+    unsigned int size;
+    int spin;
+    int alive_fd;
+};
+
+static int stopping = 0;
+
+static void futex_wake(unsigned int *addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Waits until *word moves away from 'val'. While sleeping, the request pipe
+// is checked every RING_WAIT_MS so a client that went away (closing its end
+// of the FIFO) does not leave the server blocked forever.
+static int ring_wait(struct ring *ring, unsigned int *word, unsigned int *waiters, unsigned int val){
+    for(int i = 0; i < ring->spin; i++){
+        if(__atomic_load_n(word, __ATOMIC_ACQUIRE) != val){
+            return 0;
+        }
+#ifdef __SSE2__
+        _mm_pause();
+#endif
     }
+    for(;;){
+        struct timespec timeout = {0, RING_WAIT_MS * 1000000L};
+        struct pollfd pfd = {ring->alive_fd, 0, 0};
 
-    int fd_req = open(REQ_PIPE, O_RDONLY);
+        __atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(word, __ATOMIC_SEQ_CST) != val){
+            break;
+        }
+        syscall(SYS_futex, word, FUTEX_WAIT, val, &timeout, NULL, 0);
+        if(__atomic_load_n(word, __ATOMIC_ACQUIRE) != val){
+            break;
+        }
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) || (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR)))){
+            __atomic_store_n(waiters, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    __atomic_store_n(waiters, 0, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    if(fd_req == -1){
-        perror("ERROR\ncannot open the request pipe");
-        return 1;
+static ssize_t ring_read(struct ring *ring, char *buf, size_t len){
+    struct ring_ctl *ctl = ring->ctl;
+    unsigned int head = ctl->head;
+    unsigned int tail;
+
+    while((tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE)) == head){
+        if(ring_wait(ring, &ctl->tail, &ctl->tail_waiters, head) != 0){
+            return 0;
+        }
+    }
+    // both indices live in memory the client can write
+    if(tail - head > ring->size){
+        errno = EPROTO;
+        return -1;
+    }
+    if(len > tail - head){
+        len = tail - head;
     }
+    unsigned int pos = head & (ring->size - 1);
+    size_t first = ring->size - pos < len ? ring->size - pos : len;
+    memcpy(buf, ring->data + pos, first);
+    memcpy(buf + first, ring->data, len - first);
+    __atomic_store_n(&ctl->head, head + len, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ctl->head_waiters, __ATOMIC_SEQ_CST)){
+        futex_wake(&ctl->head);
+    }
+    return len;
+}
 
-    int fd_resp = open(RESP_PIPE, O_WRONLY);
+static int ring_write(struct ring *ring, const char *buf, size_t len){
+    struct ring_ctl *ctl = ring->ctl;
+    unsigned int tail = ctl->tail;
 
-    if(fd_resp == -1){
-        perror("ERROR\ncannot open the response pipe");
-        return 1;
+    while(len > 0){
+        unsigned int head;
+        while(tail - (head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE)) == ring->size){
+            if(ring_wait(ring, &ctl->head, &ctl->head_waiters, head) != 0){
+                return -1;
+            }
+        }
+        if(tail - head > ring->size){
+            errno = EPROTO;
+            return -1;
+        }
+        size_t chunk = ring->size - (tail - head);
+        if(chunk > len){
+            chunk = len;
+        }
+        unsigned int pos = tail & (ring->size - 1);
+        size_t first = ring->size - pos < chunk ? ring->size - pos : chunk;
+        memcpy(ring->data + pos, buf, first);
+        memcpy(ring->data, buf + first, chunk - first);
+        tail += chunk;
+        buf += chunk;
+        len -= chunk;
+        __atomic_store_n(&ctl->tail, tail, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ctl->tail_waiters, __ATOMIC_SEQ_CST)){
+            futex_wake(&ctl->tail);
+        }
     }
+    return 0;
+}
 
-    char* src = "BEGIN!";
+// Maps RING_SHM and sets up the request/response rings; 'size' is rounded
+// up to a power of two.
+static char* ring_create(const char *name, unsigned int size, unsigned int *map_size, struct ring *req_ring, struct ring *resp_ring){
+    unsigned int ring_size = RING_DEFAULT_SIZE;
 
-    write(fd_resp, src, strlen(src));
-    printf("SUCCESS\n");
+    if(size > RING_MAX_SIZE){
+        return NULL;
+    }
+    if(size != 0){
+        for(ring_size = 4096; ring_size < size; ring_size <<= 1);
+    }
+    int ringFD = shm_open(name, O_CREAT | O_RDWR, 0664);
+    if(ringFD < 0){
+        return NULL;
+    }
+    *map_size = RING_DATA_OFFSET + 2 * ring_size;
+    char *map = NULL;
+    if(ftruncate(ringFD, *map_size) == 0){
+        map = (char*)mmap(0, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ringFD, 0);
+    }
+    close(ringFD);
+    if(map == NULL || map == (void*)-1){
+        shm_unlink(name);
+        return NULL;
+    }
+    memset(map, 0, RING_DATA_OFFSET);
+    *(unsigned int*)map = ring_size;
+    req_ring->ctl = (struct ring_ctl*)(map + 64);
+    req_ring->data = map + RING_DATA_OFFSET;
+    req_ring->size = ring_size;
+    resp_ring->ctl = (struct ring_ctl*)(map + 64 + sizeof(struct ring_ctl));
+    resp_ring->data = map + RING_DATA_OFFSET + ring_size;
+    resp_ring->size = ring_size;
+    return map;
+}
 
-    unsigned int shm_size;
-    unsigned int file_size;
-    int shmFD;
+// Requests are read from the pipe in large chunks and decoded from this
+// buffer; a request is only consumed once all of its fields have arrived.
+// 'skip' counts bytes still to be thrown away, which may be more than the
+// buffer holds.
+struct req_reader{
     int fd;
-    volatile char* sharedChar = NULL;
-    char* file = NULL;
+    struct ring *ring;
+    unsigned int start;
+    unsigned int end;
+    unsigned long skip;
+    char buf[REQ_BUF_SIZE];
+};
+
+static int reader_fill(struct req_reader *reader){
+    if(reader->start == reader->end){
+        reader->start = reader->end = 0;
+    } else if(reader->end == REQ_BUF_SIZE){
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
     for(;;){
-        char dst[250];
-        for(int i = 0; i < 250; i++){
-            read(fd_req, &dst[i], 1);
-            if(dst[i] == '!' || i == 249){
-                dst[i] = 0;
-                break;
-            }
+        ssize_t n;
+        if(reader->ring != NULL){
+            n = ring_read(reader->ring, reader->buf + reader->end, REQ_BUF_SIZE - reader->end);
+        } else {
+            n = read(reader->fd, reader->buf + reader->end, REQ_BUF_SIZE - reader->end);
         }
-        char var[] = "PING!";
-        if(strcmp(dst, "PING") == 0){
-            write(fd_resp, &var, strlen(var));
-            write(fd_resp, &VERSION, sizeof(VERSION));
-            write(fd_resp, "PONG!", strlen("PONG!"));
-        } else if(strcmp(dst, "CREATE_SHM") == 0){
-            read(fd_req, &shm_size, sizeof(unsigned int));
-            shmFD = shm_open("/yTJuDV", O_CREAT | O_RDWR, 0664);
-            if(shmFD < 0){
-                write(fd_resp, "CREATE_SHM!ERROR!", strlen("CREATE_SHM!ERROR!"));
-            }
-            ftruncate(shmFD, shm_size);
-            sharedChar = (volatile char*)mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFD, 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n > 0){
+            reader->end += n;
+        }
+        return n;
+    }
+}
 
-            if(sharedChar == (void*)-1){
-                write(fd_resp, "CREATE_SHM!ERROR!", strlen("CREATE_SHM!ERROR!"));
+// '!'-terminated string of at most MAX_STRING bytes (terminator included);
+// a longer string is cut after MAX_STRING - 1 characters.
+static int parse_string(const struct req_reader *reader, unsigned int *pos, char *dst){
+    unsigned int avail = reader->end - *pos;
+    unsigned int limit = avail < MAX_STRING ? avail : MAX_STRING;
+    const char *p = reader->buf + *pos;
+    const char *term = memchr(p, '!', limit);
+    unsigned int len;
+
+    if(term != NULL){
+        len = term - p;
+    } else if(avail >= MAX_STRING){
+        len = MAX_STRING - 1;
+    } else {
+        return 0;
+    }
+    memcpy(dst, p, len);
+    dst[len] = 0;
+    *pos += len + 1;
+    return 1;
+}
+
+static unsigned int get_number(const unsigned char *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int parse_number(const struct req_reader *reader, unsigned int *pos, unsigned int *value){
+    if(reader->end - *pos < sizeof(unsigned int)){
+        return 0;
+    }
+    *value = get_number((const unsigned char*)reader->buf + *pos);
+    *pos += sizeof(unsigned int);
+    return 1;
+}
+
+static void reader_skip(struct req_reader *reader){
+    unsigned int n = reader->end - reader->start;
+
+    if(n > reader->skip){
+        n = reader->skip;
+    }
+    reader->start += n;
+    reader->skip -= n;
+}
+
+static int parse_request(struct req_reader *reader, struct request *req){
+    unsigned int pos;
+    char name[MAX_STRING];
+    const struct command *command = NULL;
+
+    reader_skip(reader);
+    if(reader->skip > 0){
+        return 0;
+    }
+    pos = reader->start;
+    if(!parse_string(reader, &pos, name)){
+        return 0;
+    }
+    for(int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++){
+        if(strcmp(name, commands[i].name) == 0){
+            command = &commands[i];
+            break;
+        }
+    }
+    req->cmd = CMD_UNKNOWN;
+    if(command != NULL){
+        for(int i = 0; i < command->nargs; i++){
+            if(!parse_number(reader, &pos, &req->args[i])){
+                return 0;
             }
-            
-            write(fd_resp, "CREATE_SHM!SUCCESS!", strlen("CREATE_SHM!SUCCESS!"));
-        } else if(strcmp(dst, "WRITE_TO_SHM") == 0){
-            unsigned int offset = 0;
-            unsigned int value = 0;
-
-            read(fd_req, &offset, sizeof(unsigned int));
-            read(fd_req, &value, sizeof(unsigned int));
-
-            if(offset >= 0 && (offset + sizeof(unsigned int)) <= shm_size){
-                lseek(shmFD, offset, SEEK_SET);
-                write(shmFD, &value, sizeof(unsigned int));
-                lseek(shmFD, 0, SEEK_SET);
-                write(fd_resp, "WRITE_TO_SHM!SUCCESS!", strlen("WRITE_TO_SHM!SUCCESS!"));
+        }
+        if(command->has_path && !parse_string(reader, &pos, req->path)){
+            return 0;
+        }
+        req->vec = NULL;
+        if(command->vec_fields != 0){
+            unsigned long len = (unsigned long)req->args[command->nargs - 1] * command->vec_fields * sizeof(unsigned int);
+            if(req->args[command->nargs - 1] > READ_MULTI_MAX){
+                // too many to hold at once: drop the records as they arrive
+                reader->skip = len;
+            } else if(reader->end - pos < len){
+                return 0;
             } else {
-                write(fd_resp, "WRITE_TO_SHM!ERROR!", strlen("WRITE_TO_SHM!ERROR!"));
-            }
-        } else if(strcmp(dst, "MAP_FILE") == 0){
-            char path[250];
-            for(int i = 0; i < 250; i++){
-                read(fd_req, &path[i], 1);
-                if(path[i] == '!'){
-                    path[i] = 0;
-                    break;
-                }
-            }
-            fd = open(path, O_RDONLY);
-            if(fd == -1){
-                write(fd_resp, "MAP_FILE!ERROR!", strlen("MAP_FILE!ERROR!"));     
-                continue; 
+                req->vec = (const unsigned char*)reader->buf + pos;
+                pos += len;
             }
+        }
+        req->cmd = command->id;
+    }
+    reader->start = pos;
+    reader_skip(reader);
+    return 1;
+}
 
-            file_size = lseek(fd, 0, SEEK_END);
-            lseek(fd, 0, SEEK_SET);
-            file = (char*)mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
-            if(file == (void*)-1){
-                write(fd_resp, "MAP_FILE!ERROR!", strlen("MAP_FILE!ERROR!"));
-                close(fd);
-                continue;
-            } 
-            write(fd_resp, "MAP_FILE!SUCCESS!", strlen("MAP_FILE!SUCCESS!"));
-        } else if(strcmp(dst, "READ_FROM_FILE_OFFSET") == 0){
-            unsigned int offset = 0;
-            unsigned int no_of_bytes = 0;
+// Responses are queued as iovecs over string literals (and over 'data' for
+// values that need a copy) and sent with one writev() per batch of requests.
+struct resp_writer{
+    int fd;
+    struct ring *ring;
+    int failed;
+    int count;
+    unsigned int data_len;
+    struct iovec iov[RESP_IOV_MAX];
+    char data[RESP_DATA_SIZE];
+};
 
-            read(fd_req, &offset, sizeof(unsigned int));
-            read(fd_req, &no_of_bytes, sizeof(unsigned int));
+static void writer_flush(struct resp_writer *writer){
+    struct iovec *iov = writer->iov;
+    int count = writer->count;
 
-            if(shmFD == -1 || sharedChar == NULL || file == NULL || (offset + no_of_bytes) > file_size){
-                write(fd_resp, "READ_FROM_FILE_OFFSET!ERROR!", strlen("READ_FROM_FILE_OFFSET!ERROR!"));
+    if(writer->ring != NULL){
+        for(int i = 0; i < count && !writer->failed; i++){
+            writer->failed = ring_write(writer->ring, iov[i].iov_base, iov[i].iov_len) != 0;
+        }
+        count = 0;
+    }
+    while(count > 0 && !writer->failed){
+        ssize_t n = writev(writer->fd, iov, count);
+        if(n < 0){
+            if(errno == EINTR){
                 continue;
             }
+            // EPIPE: the client closed its end; EAGAIN: it never opened
+            // it and the pipe is full (see session_attach_resp())
+            writer->failed = 1;
+            break;
+        }
+        while(count > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    writer->count = 0;
+    writer->data_len = 0;
+}
 
-            for(int i = 0; i < no_of_bytes; i++){
-                sharedChar[i] = file[offset + i];
-            }
+static void writer_add(struct resp_writer *writer, const void *buf, size_t len){
+    if(writer->count == RESP_IOV_MAX){
+        writer_flush(writer);
+    }
+    writer->iov[writer->count].iov_base = (void*)buf;
+    writer->iov[writer->count].iov_len = len;
+    writer->count++;
+}
+
+static void writer_add_number(struct resp_writer *writer, unsigned int value){
+    unsigned char *p;
 
-            write(fd_resp, "READ_FROM_FILE_OFFSET!SUCCESS!", strlen("READ_FROM_FILE_OFFSET!SUCCESS!"));
-        } else if (strcmp(dst, "READ_FROM_FILE_SECTION") == 0){
-            unsigned int section_no = 0;
-            unsigned int offset = 0;
-            unsigned int no_of_bytes = 0;
+    if(writer->count == RESP_IOV_MAX || writer->data_len + sizeof(unsigned int) > RESP_DATA_SIZE){
+        writer_flush(writer);
+    }
+    p = (unsigned char*)writer->data + writer->data_len;
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+    writer->data_len += sizeof(unsigned int);
+    writer_add(writer, p, sizeof(unsigned int));
+}
 
-            read(fd_req, &section_no, sizeof(unsigned int));
-            read(fd_req, &offset, sizeof(unsigned int));
-            read(fd_req, &no_of_bytes, sizeof(unsigned int));
+// Pending responses are flushed only when no complete request is buffered,
+// so a client that streams requests gets its answers in batches.
+static int read_request(struct req_reader *reader, struct resp_writer *writer, struct request *req){
+    while(!parse_request(reader, req)){
+        writer_flush(writer);
+        // a ring the client broke or left ends the session
+        if(writer->failed || reader_fill(reader) <= 0){
+            return 0;
+        }
+    }
+    return 1;
+}
 
-            unsigned short header_size = *(unsigned short*)(file + file_size - 6);
-            unsigned int header_start = file_size - header_size;
+// Copies file bytes into the shared region. Large copies use non-temporal
+// stores so they do not evict the cache on their way to memory. On return
+// all stores are globally visible (sfence + release fence); the reply sent
+// afterwards on the response channel is what publishes the data to the
+// client, which must not look at the region before reading that reply.
+static void shm_copy(char *dst, const char *src, size_t n){
+#ifdef __SSE2__
+    if(n >= NT_COPY_THRESHOLD){
+        size_t head = (16 - ((unsigned long)dst & 15)) & 15;
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        n -= head;
+        for(; n >= 64; n -= 64, dst += 64, src += 64){
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_stream_si128((__m128i*)dst, a);
+            _mm_stream_si128((__m128i*)(dst + 16), b);
+            _mm_stream_si128((__m128i*)(dst + 32), c);
+            _mm_stream_si128((__m128i*)(dst + 48), d);
+        }
+        _mm_sfence();
+    }
+#endif
+    memcpy(dst, src, n);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-            unsigned int no_of_sections = *(unsigned int*)(file + header_start + 4);
+// CREATE_SHM segments can be tuned with A3_SHM_HUGEPAGES (map at a 2MB
+// boundary and ask for transparent huge pages), A3_SHM_NODE (a NUMA node
+// number, or "local" for the node the server is running on) and
+// A3_SHM_POPULATE (fault the whole segment in before replying). Each one is
+// best effort: if the kernel refuses, the segment is still created normally.
+//
+// A3_SHM_NODE is server-side placement: the node comes from the server's
+// environment (or the CPU the server starts on) and applies to every
+// session. The protocol does not say where a client runs, so a client on
+// another node is not followed; whoever starts the server picks the node
+// the clients are expected to be on.
+#define SHM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define SHM_NODE_NONE (-1)
+// mbind() is called through syscall() to avoid depending on libnuma, so
+// <numaif.h> is not included; the value is the kernel's (uapi mempolicy.h).
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
 
-            if(section_no < 1 || section_no > no_of_sections){
-                write(fd_resp, "READ_FROM_FILE_SECTION!ERROR!", strlen("READ_FROM_FILE_SECTION!ERROR!"));
-                continue;
-            }
+static struct{
+    int hugepages;
+    int populate;
+    int node;
+} shm_opts;
 
-            unsigned int section_header_start = header_start + 5 + (section_no - 1) * 19;
-            unsigned int section_offset = *(unsigned int*)(file + section_header_start + 11);
-            unsigned int section_size = *(unsigned int*)(file + section_header_start + 15);
+static void shm_opts_init(void){
+    char *huge = getenv("A3_SHM_HUGEPAGES");
+    char *populate = getenv("A3_SHM_POPULATE");
+    char *node = getenv("A3_SHM_NODE");
 
-            if(offset + no_of_bytes > section_size){
-                write(fd_resp, "READ_FROM_FILE_SECTION!ERROR!", strlen("READ_FROM_FILE_SECTION!ERROR!"));
-                continue;        
+    shm_opts.hugepages = huge != NULL && atoi(huge) != 0;
+    shm_opts.populate = populate != NULL && atoi(populate) != 0;
+    shm_opts.node = SHM_NODE_NONE;
+    if(node != NULL){
+        if(strcmp(node, "local") == 0){
+            unsigned int cpu, local;
+            if(syscall(SYS_getcpu, &cpu, &local, NULL) == 0){
+                shm_opts.node = local;
             }
+        } else if(node[0] >= '0' && node[0] <= '9'){
+            shm_opts.node = atoi(node);
+        }
+    }
+}
+
+// Reserves size bytes at a huge page boundary so the shm mapping can be
+// backed by PMD-sized pages; the slack around it is handed back.
+static void* shm_reserve_aligned(size_t size){
+    char *area = mmap(0, size + SHM_HUGEPAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(area == MAP_FAILED){
+        return NULL;
+    }
+    char *aligned = (char*)(((unsigned long)area + SHM_HUGEPAGE_SIZE - 1) & ~(unsigned long)(SHM_HUGEPAGE_SIZE - 1));
+    if(aligned > area){
+        munmap(area, aligned - area);
+    }
+    munmap(aligned + size, area + SHM_HUGEPAGE_SIZE - aligned);
+    return aligned;
+}
+
+static void shm_populate(char *addr, size_t size){
+    if(madvise(addr, size, MADV_POPULATE_WRITE) == 0){
+        return;
+    }
+    // Older kernels: touch every page. Reading is enough to allocate a
+    // shmem page and leaves whatever a client already wrote alone.
+    long page = sysconf(_SC_PAGESIZE);
+    for(size_t i = 0; i < size; i += page){
+        (void)*(volatile char*)(addr + i);
+    }
+}
+
+static char* shm_map(int fd, size_t size){
+    char *addr = NULL;
+    int flags = MAP_SHARED;
+
+    if(shm_opts.hugepages && size >= SHM_HUGEPAGE_SIZE){
+        addr = shm_reserve_aligned(size);
+        if(addr != NULL){
+            flags |= MAP_FIXED;
+        }
+    }
+    char *shm = mmap(addr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if(shm == MAP_FAILED){
+        if(addr != NULL){
+            munmap(addr, size);
+        }
+        return NULL;
+    }
+    if(shm_opts.hugepages){
+        madvise(shm, size, MADV_HUGEPAGE);
+    }
+    if(shm_opts.node != SHM_NODE_NONE && shm_opts.node < (int)(8 * sizeof(unsigned long))){
+        // The policy sticks to the shmem object, so it has to be in place
+        // before any page of the segment is allocated.
+        unsigned long mask = 1UL << shm_opts.node;
+        syscall(SYS_mbind, shm, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0);
+    }
+    if(shm_opts.populate){
+        shm_populate(shm, size);
+    }
+    return shm;
+}
+
+// MAP_FILE goes through a cache of mapped files shared by all sessions,
+// keyed by path and validated against the inode, size and mtime from
+// stat(). Sessions hold a reference on the file they have mapped;
+// unreferenced files stay mapped on an LRU list until the A3_MAP_CACHE_FILES
+// / A3_MAP_CACHE_MB budget forces them out.
+struct section{
+    unsigned int offset;
+    unsigned int size;
+    unsigned int logical_start;
+};
+
+struct mapped_file{
+    char path[MAX_STRING];
+    unsigned int hash;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int fd;
+    char *data;
+    unsigned int size;
+    struct section *sections;
+    unsigned int no_of_sections;
+    unsigned long logical_size;
+    int refs;
+    int stale;
+    struct mapped_file *hash_next;
+    struct mapped_file *lru_prev;
+    struct mapped_file *lru_next;
+};
+
+struct file_cache{
+    pthread_mutex_t lock;
+    struct mapped_file *buckets[FILE_CACHE_BUCKETS];
+    struct mapped_file lru;
+    int count;
+    size_t bytes;
+    int max_files;
+    size_t max_bytes;
+};
+
+static struct file_cache file_cache;
+
+static unsigned int path_hash(const char *path){
+    unsigned int hash = 2166136261u;
+
+    for(; *path != 0; path++){
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static void file_cache_init(void){
+    char *files = getenv("A3_MAP_CACHE_FILES");
+    char *mb = getenv("A3_MAP_CACHE_MB");
+
+    pthread_mutex_init(&file_cache.lock, NULL);
+    file_cache.lru.lru_prev = file_cache.lru.lru_next = &file_cache.lru;
+    file_cache.max_files = files != NULL ? atoi(files) : FILE_CACHE_FILES;
+    file_cache.max_bytes = (size_t)(mb != NULL ? atol(mb) : FILE_CACHE_MB) << 20;
+}
+
+static void lru_unlink(struct mapped_file *mf){
+    mf->lru_prev->lru_next = mf->lru_next;
+    mf->lru_next->lru_prev = mf->lru_prev;
+    mf->lru_prev = mf->lru_next = NULL;
+}
+
+static void hash_unlink(struct mapped_file *mf){
+    struct mapped_file **p = &file_cache.buckets[mf->hash % FILE_CACHE_BUCKETS];
+
+    for(; *p != NULL; p = &(*p)->hash_next){
+        if(*p == mf){
+            *p = mf->hash_next;
+            break;
+        }
+    }
+    mf->stale = 1;
+}
+
+static void mapped_file_free(struct mapped_file *mf){
+    free(mf->sections);
+    munmap(mf->data, mf->size);
+    close(mf->fd);
+    file_cache.count--;
+    file_cache.bytes -= mf->size;
+    free(mf);
+}
+
+// Decodes the SF header at the end of the file once, when it is mapped:
+// section offsets and sizes plus the start of each section in the logical
+// space, where every section occupies a whole number of LOGICAL_ALIGNMENT
+// blocks. A file whose header does not hold together gets no sections.
+static void section_table_build(struct mapped_file *mf){
+    const unsigned char *file = (const unsigned char*)mf->data;
+    unsigned int header_size;
+    unsigned int header_start;
+    unsigned int no_of_sections;
+    unsigned long logical = 0;
+
+    if(mf->size < 11 || memcmp(file + mf->size - 4, SF_MAGIC, 4) != 0){
+        return;
+    }
+    header_size = file[mf->size - 6] | (file[mf->size - 5] << 8);
+    if(header_size < 11 || header_size > mf->size){
+        return;
+    }
+    header_start = mf->size - header_size;
+    no_of_sections = file[header_start + 4];
+    if(11 + no_of_sections * SECTION_HEADER_SIZE > header_size){
+        return;
+    }
+    mf->sections = (struct section*)malloc(no_of_sections * sizeof(struct section) + 1);
+    if(mf->sections == NULL){
+        return;
+    }
+    for(unsigned int i = 0; i < no_of_sections; i++){
+        const char *entry = (const char*)file + header_start + 5 + i * SECTION_HEADER_SIZE;
+        struct section *sect = &mf->sections[i];
+        memcpy(&sect->offset, entry + 11, sizeof(unsigned int));
+        memcpy(&sect->size, entry + 15, sizeof(unsigned int));
+        if((unsigned long)sect->offset + sect->size > mf->size || logical > 0xFFFFFFFFu){
+            free(mf->sections);
+            mf->sections = NULL;
+            return;
+        }
+        sect->logical_start = logical;
+        logical += (sect->size + LOGICAL_ALIGNMENT - 1) / LOGICAL_ALIGNMENT * LOGICAL_ALIGNMENT;
+    }
+    mf->no_of_sections = no_of_sections;
+    mf->logical_size = logical;
+}
+
+// Drops unreferenced files, least recently used first, while over budget.
+static void file_cache_evict(void){
+    while((file_cache.count > file_cache.max_files || file_cache.bytes > file_cache.max_bytes) &&
+          file_cache.lru.lru_prev != &file_cache.lru){
+        struct mapped_file *victim = file_cache.lru.lru_prev;
+        lru_unlink(victim);
+        hash_unlink(victim);
+        mapped_file_free(victim);
+    }
+}
+
+static struct mapped_file* file_cache_find(const char *path, unsigned int hash, const struct stat *st){
+    struct mapped_file *mf = file_cache.buckets[hash % FILE_CACHE_BUCKETS];
+
+    for(; mf != NULL; mf = mf->hash_next){
+        if(mf->hash != hash || strcmp(mf->path, path) != 0){
+            continue;
+        }
+        if(mf->dev == st->st_dev && mf->ino == st->st_ino && mf->size == st->st_size &&
+           mf->mtime.tv_sec == st->st_mtim.tv_sec && mf->mtime.tv_nsec == st->st_mtim.tv_nsec){
+            return mf;
+        }
+        // the path now names a different or modified file
+        hash_unlink(mf);
+        if(mf->refs == 0){
+            lru_unlink(mf);
+            mapped_file_free(mf);
+        }
+        return NULL;
+    }
+    return NULL;
+}
+
+// Takes a reference, pulling the file off the LRU list if it was idle.
+static void file_cache_ref(struct mapped_file *mf){
+    if(mf->refs++ == 0){
+        lru_unlink(mf);
+    }
+}
+
+static struct mapped_file* file_cache_acquire(const char *path){
+    unsigned int hash = path_hash(path);
+    struct mapped_file *mf;
+    struct mapped_file *winner;
+    struct stat st;
+
+    if(stat(path, &st) != 0){
+        return NULL;
+    }
+    pthread_mutex_lock(&file_cache.lock);
+    mf = file_cache_find(path, hash, &st);
+    if(mf != NULL){
+        file_cache_ref(mf);
+        pthread_mutex_unlock(&file_cache.lock);
+        return mf;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+
+    mf = (struct mapped_file*)calloc(1, sizeof(struct mapped_file));
+    if(mf == NULL){
+        return NULL;
+    }
+    mf->fd = open(path, O_RDONLY);
+    if(mf->fd == -1 || fstat(mf->fd, &st) != 0 || st.st_size == 0 || st.st_size > 0xFFFFFFFFu){
+        if(mf->fd != -1){
+            close(mf->fd);
+        }
+        free(mf);
+        return NULL;
+    }
+    mf->data = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, mf->fd, 0);
+    if(mf->data == (void*)-1){
+        close(mf->fd);
+        free(mf);
+        return NULL;
+    }
+    snprintf(mf->path, MAX_STRING, "%s", path);
+    mf->hash = hash;
+    mf->dev = st.st_dev;
+    mf->ino = st.st_ino;
+    mf->mtime = st.st_mtim;
+    mf->size = st.st_size;
+    mf->refs = 1;
+    section_table_build(mf);
+
+    pthread_mutex_lock(&file_cache.lock);
+    // another session may have mapped the same file while the lock was dropped
+    winner = file_cache_find(path, hash, &st);
+    if(winner != NULL){
+        file_cache_ref(winner);
+        pthread_mutex_unlock(&file_cache.lock);
+        free(mf->sections);
+        munmap(mf->data, mf->size);
+        close(mf->fd);
+        free(mf);
+        return winner;
+    }
+    mf->hash_next = file_cache.buckets[hash % FILE_CACHE_BUCKETS];
+    file_cache.buckets[hash % FILE_CACHE_BUCKETS] = mf;
+    file_cache.count++;
+    file_cache.bytes += mf->size;
+    file_cache_evict();
+    pthread_mutex_unlock(&file_cache.lock);
+    return mf;
+}
+
+static void file_cache_release(struct mapped_file *mf){
+    if(mf == NULL){
+        return;
+    }
+    pthread_mutex_lock(&file_cache.lock);
+    if(--mf->refs == 0){
+        if(mf->stale){
+            mapped_file_free(mf);
+        } else {
+            mf->lru_next = file_cache.lru.lru_next;
+            mf->lru_prev = &file_cache.lru;
+            mf->lru_next->lru_prev = mf;
+            file_cache.lru.lru_next = mf;
+            file_cache_evict();
+        }
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+static int locate_section(const struct mapped_file *mf, unsigned int section_no, unsigned int offset, unsigned int no_of_bytes, unsigned int *file_offset){
+    if(mf == NULL || section_no < 1 || section_no > mf->no_of_sections){
+        return -1;
+    }
+
+    const struct section *sect = &mf->sections[section_no - 1];
+    if((unsigned long)offset + no_of_bytes > sect->size){
+        return -1;
+    }
+    *file_offset = sect->offset + offset;
+    return 0;
+}
+
+static int locate_logical(const struct mapped_file *mf, unsigned int logical_offset, unsigned int *file_offset){
+    if(mf == NULL || mf->no_of_sections == 0 || logical_offset >= mf->logical_size){
+        return -1;
+    }
+
+    // last section starting at or before logical_offset; empty sections
+    // share their start with the next one and are skipped this way
+    unsigned int lo = 0;
+    unsigned int hi = mf->no_of_sections - 1;
+    while(lo < hi){
+        unsigned int mid = (lo + hi + 1) / 2;
+        if(mf->sections[mid].logical_start <= logical_offset){
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    *file_offset = mf->sections[lo].offset + (logical_offset - mf->sections[lo].logical_start);
+    return 0;
+}
+
+// Zero-copy access: SHARE_FILE hands the descriptor of the mapped file to
+// the client over a unix socket (SCM_RIGHTS), and the LOCATE_* commands
+// answer with file offsets instead of copying, so the client can map the
+// page-aligned window it needs itself. READ_FROM_* remain the copy path.
+static int share_listen(const char *path){
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if(sock == -1){
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-            for(int i = 0; i < no_of_bytes; i++){
-                sharedChar[i] = file[section_offset + offset + i];
+static int share_fd(int conn, int fd){
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union{
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Each client talks to its own session: a pipe pair, a shm segment, a ring
+// segment, a share socket and the currently mapped file. Session 0 uses the
+// well-known names; OPEN_SESSION creates session N with the same names
+// suffixed by ".N". Sessions on pipes are multiplexed over one epoll set
+// served by a worker pool (EPOLLONESHOT, so a session is only ever handled
+// by one worker at a time); a session that switches to the rings gets a
+// thread of its own, since futex waits cannot be polled.
+struct session{
+    int id;
+    int fd_req;
+    int fd_resp;
+    int resp_attached;
+    char req_path[NAME_SIZE];
+    char resp_path[NAME_SIZE];
+    char shm_name[NAME_SIZE];
+    char ring_name[NAME_SIZE];
+    char sock_path[NAME_SIZE];
+    char* sharedChar;
+    unsigned int shm_size;
+    struct mapped_file *mapped;
+    struct ring req_ring;
+    struct ring resp_ring;
+    char *ring_map;
+    unsigned int ring_map_size;
+    pthread_t ring_thread;
+    int has_ring_thread;
+    struct req_reader reader;
+    struct resp_writer writer;
+};
+
+// SHARE_FILE state of the session in the same slot. The listening socket
+// sits in the epoll set (EPOLLONESHOT) with its share_point as data, so a
+// worker only runs when a client connects instead of waiting for it.
+// These live as long as the server: a worker may pick up an event for a
+// session that is going away, and then finds sock == -1 or nothing to
+// accept. One hand-off is pending at a time; a newer SHARE_FILE replaces it.
+struct share_point{
+    pthread_mutex_t lock;
+    int sock;
+    int fd;
+};
+
+struct server{
+    int epfd;
+    int stopfd;
+    int nworkers;
+    pthread_t workers[MAX_WORKERS];
+    pthread_mutex_t lock;
+    struct session *sessions[MAX_SESSIONS];
+    struct share_point shares[MAX_SESSIONS];
+    int next_id;
+};
+
+static struct server server;
+
+static void share_arm(struct share_point *sp, int op){
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = sp;
+    epoll_ctl(server.epfd, op, sp->sock, &ev);
+}
+
+static int is_share_point(void *ptr){
+    return (struct share_point*)ptr >= server.shares && (struct share_point*)ptr < server.shares + MAX_SESSIONS;
+}
+
+// Queues 'fd' for the next client that connects to the session's socket.
+static int share_offer(struct session *s, int fd){
+    struct share_point *sp = &server.shares[s->id];
+    int ret = -1;
+
+    pthread_mutex_lock(&sp->lock);
+    if(sp->sock == -1 && (sp->sock = share_listen(s->sock_path)) != -1){
+        share_arm(sp, EPOLL_CTL_ADD);
+    }
+    if(sp->sock != -1 && (fd = dup(fd)) != -1){
+        if(sp->fd != -1){
+            close(sp->fd);
+        }
+        sp->fd = fd;
+        share_arm(sp, EPOLL_CTL_MOD);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return ret;
+}
+
+static void share_run(struct share_point *sp){
+    pthread_mutex_lock(&sp->lock);
+    if(sp->sock != -1){
+        int conn;
+        while((conn = accept(sp->sock, NULL, NULL)) != -1){
+            if(sp->fd != -1){
+                share_fd(conn, sp->fd);
+                close(sp->fd);
+                sp->fd = -1;
             }
+            close(conn);
+        }
+        share_arm(sp, EPOLL_CTL_MOD);
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
 
-            write(fd_resp, "READ_FROM_FILE_SECTION!SUCCESS!", strlen("READ_FROM_FILE_SECTION!SUCCESS!"));
-        } else if(strcmp(dst, "READ_FROM_LOGICAL_SPACE_OFFSET") == 0){
-            unsigned int logical_offset = 0;
-            unsigned int no_of_bytes = 0;
-
-            read(fd_req, &logical_offset, sizeof(unsigned int));
-            read(fd_req, &no_of_bytes, sizeof(unsigned int));
-
-            unsigned short header_size = *(unsigned short*)(file + file_size - 6);
-            unsigned int header_start = file_size - header_size;
-            unsigned int no_of_sections = *(unsigned int*)(file + header_start + 4);
-            unsigned int current_offset = 0;
-            int i  = 0;
-
-            for(i = 0; i < no_of_sections; i++){ 
-                unsigned int section_header_start = header_start + 5 + i * 19;
-                unsigned int section_size = *(unsigned int*)(file + section_header_start + 15);  
-                unsigned int next_offset = current_offset + (section_size / 3072 + 1) * 3072;
-                if(current_offset <= logical_offset && logical_offset < next_offset){
-                    break;
-                }
-                current_offset = next_offset;
+static void share_close(struct session *s){
+    struct share_point *sp = &server.shares[s->id];
+
+    pthread_mutex_lock(&sp->lock);
+    if(sp->sock != -1){
+        close(sp->sock);
+        unlink(s->sock_path);
+        sp->sock = -1;
+    }
+    if(sp->fd != -1){
+        close(sp->fd);
+        sp->fd = -1;
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static void session_names(struct session *s){
+    if(s->id == 0){
+        snprintf(s->req_path, NAME_SIZE, "%s", REQ_PIPE);
+        snprintf(s->resp_path, NAME_SIZE, "%s", RESP_PIPE);
+        snprintf(s->shm_name, NAME_SIZE, "%s", SHM_NAME);
+        snprintf(s->ring_name, NAME_SIZE, "%s", RING_SHM);
+        snprintf(s->sock_path, NAME_SIZE, "%s", SHARE_SOCK);
+    } else {
+        snprintf(s->req_path, NAME_SIZE, "%s.%d", REQ_PIPE, s->id);
+        snprintf(s->resp_path, NAME_SIZE, "%s.%d", RESP_PIPE, s->id);
+        snprintf(s->shm_name, NAME_SIZE, "%s.%d", SHM_NAME, s->id);
+        snprintf(s->ring_name, NAME_SIZE, "%s.%d", RING_SHM, s->id);
+        snprintf(s->sock_path, NAME_SIZE, "%s.%d", SHARE_SOCK, s->id);
+    }
+}
+
+static struct session* session_new(int id, int fd_req, int fd_resp){
+    struct session *s = (struct session*)calloc(1, sizeof(struct session));
+
+    if(s == NULL){
+        return NULL;
+    }
+    s->id = id;
+    s->fd_req = fd_req;
+    s->fd_resp = fd_resp;
+    s->resp_attached = fd_resp != -1;
+    s->reader.fd = fd_req;
+    s->writer.fd = fd_resp;
+    session_names(s);
+    return s;
+}
+
+static void session_destroy(struct session *s){
+    if(s->has_ring_thread){
+        pthread_join(s->ring_thread, NULL);
+    }
+    writer_flush(&s->writer);
+    file_cache_release(s->mapped);
+    shm_unlink(s->shm_name);
+    if(s->sharedChar != NULL){
+        munmap((void*)s->sharedChar, s->shm_size);
+    }
+    close(s->fd_resp);
+    close(s->fd_req);
+    unlink(s->resp_path);
+    unlink(s->req_path);
+    if(s->ring_map != NULL){
+        munmap(s->ring_map, s->ring_map_size);
+        shm_unlink(s->ring_name);
+    }
+    free(s);
+}
+
+static void server_stop(void){
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&server.lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&server.lock);
+    write(server.stopfd, &one, sizeof(one));
+}
+
+// Creates the pipes of a new session. The request pipe is opened
+// non-blocking so it can sit in the epoll set before the client opens it;
+// the response pipe is opened read-write and non-blocking so the open does
+// not wait for the client either, and BEGIN is already waiting there when
+// it does. session_attach_resp() replaces it once the client is there.
+static struct session* open_session(void){
+    struct session *s = NULL;
+
+    pthread_mutex_lock(&server.lock);
+    for(int i = 1; i < MAX_SESSIONS; i++){
+        if(server.sessions[i] == NULL){
+            s = session_new(i, -1, -1);
+            server.sessions[i] = s;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    if(s == NULL){
+        return NULL;
+    }
+    unlink(s->req_path);
+    unlink(s->resp_path);
+    if(mkfifo(s->req_path, 0644) != 0 || mkfifo(s->resp_path, 0644) != 0 ||
+       (s->fd_req = open(s->req_path, O_RDONLY | O_NONBLOCK)) == -1 ||
+       (s->fd_resp = open(s->resp_path, O_RDWR | O_NONBLOCK)) == -1){
+        pthread_mutex_lock(&server.lock);
+        server.sessions[s->id] = NULL;
+        pthread_mutex_unlock(&server.lock);
+        session_destroy(s);
+        return NULL;
+    }
+    s->reader.fd = s->fd_req;
+    s->writer.fd = s->fd_resp;
+    RESPOND(&s->writer, "BEGIN!");
+    writer_flush(&s->writer);
+    return s;
+}
+
+// While the server holds a read end of the response pipe itself, a client
+// that goes away never turns a write into EPIPE. Once the client has opened
+// its end, the descriptor is swapped (same number) for a blocking
+// write-only one. Until then, a pipe that fills up fails with EAGAIN.
+static void session_attach_resp(struct session *s){
+    int fd = open(s->resp_path, O_WRONLY | O_NONBLOCK);
+
+    if(fd == -1){
+        // ENXIO: the client has not opened the pipe yet
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if(dup2(fd, s->fd_resp) != -1){
+        s->resp_attached = 1;
+    }
+    close(fd);
+}
+
+static void close_session(struct session *s){
+    if(s->id == 0){
+        server_stop();
+        return;
+    }
+    epoll_ctl(server.epfd, EPOLL_CTL_DEL, s->fd_req, NULL);
+    pthread_mutex_lock(&server.lock);
+    if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+        // main() tears down whatever is left in the table
+        pthread_mutex_unlock(&server.lock);
+        return;
+    }
+    // before the slot is given up, since its share_point goes with it
+    share_close(s);
+    server.sessions[s->id] = NULL;
+    pthread_mutex_unlock(&server.lock);
+    if(s->has_ring_thread){
+        // called from the ring thread itself, which cannot join itself
+        pthread_detach(s->ring_thread);
+        s->has_ring_thread = 0;
+    }
+    session_destroy(s);
+}
+
+static int session_watch(struct session *s, int op){
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    return epoll_ctl(server.epfd, op, s->fd_req, &ev);
+}
+
+// A copy out of the mapped file must stay inside both the file and shm.
+static int read_fits(const struct session *s, unsigned long file_offset, unsigned long no_of_bytes){
+    return s->sharedChar != NULL && s->mapped != NULL && no_of_bytes <= s->shm_size &&
+           file_offset + no_of_bytes <= s->mapped->size;
+}
+
+// READ_MULTI copies a batch of slices into the shared region in one
+// request. Each record is (mode, a, b, length, shm offset), where mode 0
+// reads file offset a, mode 1 reads offset b of section a, and mode 2 reads
+// logical offset a. Every record is checked before anything is copied, so
+// an ERROR reply leaves the region untouched. Slices whose destinations
+// overlap end up with unspecified contents.
+enum{
+    READ_MULTI_OFFSET,
+    READ_MULTI_SECTION,
+    READ_MULTI_LOGICAL
+};
+
+struct read_slice{
+    const char *src;
+    char *dst;
+    unsigned int len;
+};
+
+struct read_multi_job{
+    const struct read_slice *slices;
+    unsigned int count;
+    unsigned long from;
+    unsigned long to;
+};
+
+static int read_multi_prepare(const struct session *s, const unsigned char *vec, unsigned int count, struct read_slice *slices){
+    if(s->sharedChar == NULL || s->mapped == NULL){
+        return -1;
+    }
+    for(unsigned int i = 0; i < count; i++, vec += READ_MULTI_FIELDS * sizeof(unsigned int)){
+        unsigned int mode = get_number(vec);
+        unsigned int a = get_number(vec + 4);
+        unsigned int b = get_number(vec + 8);
+        unsigned int len = get_number(vec + 12);
+        unsigned int dst = get_number(vec + 16);
+        unsigned int file_offset = a;
+
+        if(mode == READ_MULTI_SECTION){
+            if(locate_section(s->mapped, a, b, len, &file_offset) != 0){
+                return -1;
             }
-            if(i == no_of_sections){
-                write(fd_resp, "READ_FROM_LOGICAL_SPACE_OFFSET!ERROR!", strlen("READ_FROM_LOGICAL_SPACE_OFFSET!ERROR!"));
-                continue;
+        } else if(mode == READ_MULTI_LOGICAL){
+            if(locate_logical(s->mapped, a, &file_offset) != 0){
+                return -1;
             }
+        } else if(mode != READ_MULTI_OFFSET){
+            return -1;
+        }
+        if((unsigned long)file_offset + len > s->mapped->size || (unsigned long)dst + len > s->shm_size){
+            return -1;
+        }
+        slices[i].src = s->mapped->data + file_offset;
+        slices[i].dst = s->sharedChar + dst;
+        slices[i].len = len;
+    }
+    return 0;
+}
 
-            unsigned int offset_in_section = logical_offset - current_offset;
-            unsigned int section_header_start = header_start + 5 + i * 19;
-            unsigned int section_offset = *(unsigned int*)(file + section_header_start + 11);
-            for(int j = 0; j < no_of_bytes; j++){
-                sharedChar[j] = file[section_offset + offset_in_section + j];
-            }
-            write(fd_resp, "READ_FROM_LOGICAL_SPACE_OFFSET!SUCCESS!", strlen("READ_FROM_LOGICAL_SPACE_OFFSET!SUCCESS!"));
-        } else if(strcmp(dst, "EXIT") == 0){
-            munmap((void*)file, file_size);
-            close(fd);
-            shm_unlink("/yTJuDV");
-            munmap((void*)sharedChar, shm_size);
-            close(fd_resp);
-            close(fd_req);
-            unlink(RESP_PIPE);
-            unlink(REQ_PIPE);
+// Copies bytes [from, to) of the concatenation of all slices.
+static void* read_multi_copy(void *arg){
+    const struct read_multi_job *job = arg;
+    unsigned long pos = 0;
+
+    for(unsigned int i = 0; i < job->count && pos < job->to; i++){
+        const struct read_slice *slice = &job->slices[i];
+        unsigned long start = pos > job->from ? pos : job->from;
+        unsigned long end = pos + slice->len < job->to ? pos + slice->len : job->to;
+
+        if(start < end){
+            shm_copy(slice->dst + (start - pos), slice->src + (start - pos), end - start);
+        }
+        pos += slice->len;
+    }
+    return NULL;
+}
+
+// Large batches are split by bytes, not by slice, so one big slice does
+// not leave the other threads idle.
+static void read_multi(const struct read_slice *slices, unsigned int count){
+    struct read_multi_job jobs[READ_MULTI_THREADS];
+    pthread_t threads[READ_MULTI_THREADS];
+    unsigned long total = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = 1;
+
+    for(unsigned int i = 0; i < count; i++){
+        total += slices[i].len;
+    }
+    if(total >= READ_MULTI_PARALLEL && cpus > 1){
+        nthreads = cpus < READ_MULTI_THREADS ? cpus : READ_MULTI_THREADS;
+    }
+    for(int i = 0; i < nthreads; i++){
+        jobs[i].slices = slices;
+        jobs[i].count = count;
+        jobs[i].from = total * i / nthreads;
+        jobs[i].to = total * (i + 1) / nthreads;
+    }
+
+    int started = 1;
+    for(; started < nthreads; started++){
+        if(pthread_create(&threads[started], NULL, read_multi_copy, &jobs[started]) != 0){
+            break;
+        }
+    }
+    // parts that could not get a thread are copied here
+    read_multi_copy(&jobs[0]);
+    for(int i = started; i < nthreads; i++){
+        read_multi_copy(&jobs[i]);
+    }
+    for(int i = 1; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Runs one request; returns 1 when the session is over.
+static int handle_request(struct session *s, struct request *req){
+    struct resp_writer *writer = &s->writer;
+
+    if(req->cmd == CMD_PING){
+        RESPOND(writer, "PING!");
+        writer_add_number(writer, VERSION);
+        RESPOND(writer, "PONG!");
+    } else if(req->cmd == CMD_CREATE_SHM){
+        if(s->sharedChar != NULL){
+            munmap((void*)s->sharedChar, s->shm_size);
+            s->sharedChar = NULL;
+        }
+        s->shm_size = req->args[0];
+        int shmFD = shm_open(s->shm_name, O_CREAT | O_RDWR, 0664);
+        if(shmFD < 0){
+            RESPOND(writer, "CREATE_SHM!ERROR!");
+            return 0;
+        }
+        if(ftruncate(shmFD, s->shm_size) == 0){
+            s->sharedChar = shm_map(shmFD, s->shm_size);
+        }
+        close(shmFD);
+
+        if(s->sharedChar == NULL){
+            RESPOND(writer, "CREATE_SHM!ERROR!");
             return 0;
         }
+
+        RESPOND(writer, "CREATE_SHM!SUCCESS!");
+    } else if(req->cmd == CMD_WRITE_TO_SHM){
+        unsigned int offset = req->args[0];
+        unsigned int value = req->args[1];
+
+        if(s->sharedChar != NULL && (offset + sizeof(unsigned int)) <= s->shm_size){
+            shm_copy(s->sharedChar + offset, (const char*)&value, sizeof(unsigned int));
+            RESPOND(writer, "WRITE_TO_SHM!SUCCESS!");
+        } else {
+            RESPOND(writer, "WRITE_TO_SHM!ERROR!");
+        }
+    } else if(req->cmd == CMD_MAP_FILE){
+        struct mapped_file *mf = file_cache_acquire(req->path);
+        if(mf == NULL){
+            RESPOND(writer, "MAP_FILE!ERROR!");     
+            return 0; 
+        }
+        file_cache_release(s->mapped);
+        s->mapped = mf;
+        RESPOND(writer, "MAP_FILE!SUCCESS!");
+    } else if(req->cmd == CMD_READ_FROM_FILE_OFFSET){
+        unsigned int offset = req->args[0];
+        unsigned int no_of_bytes = req->args[1];
+
+        if(!read_fits(s, offset, no_of_bytes)){
+            RESPOND(writer, "READ_FROM_FILE_OFFSET!ERROR!");
+            return 0;
+        }
+
+        shm_copy(s->sharedChar, s->mapped->data + offset, no_of_bytes);
+
+        RESPOND(writer, "READ_FROM_FILE_OFFSET!SUCCESS!");
+    } else if (req->cmd == CMD_READ_FROM_FILE_SECTION){
+        unsigned int file_offset = 0;
+
+        if(locate_section(s->mapped, req->args[0], req->args[1], req->args[2], &file_offset) != 0 || !read_fits(s, file_offset, req->args[2])){
+            RESPOND(writer, "READ_FROM_FILE_SECTION!ERROR!");
+            return 0;        
+        }
+
+        shm_copy(s->sharedChar, s->mapped->data + file_offset, req->args[2]);
+
+        RESPOND(writer, "READ_FROM_FILE_SECTION!SUCCESS!");
+    } else if(req->cmd == CMD_READ_FROM_LOGICAL_SPACE_OFFSET){
+        unsigned int file_offset = 0;
+
+        if(locate_logical(s->mapped, req->args[0], &file_offset) != 0 || !read_fits(s, file_offset, req->args[1])){
+            RESPOND(writer, "READ_FROM_LOGICAL_SPACE_OFFSET!ERROR!");
+            return 0;
+        }
+        shm_copy(s->sharedChar, s->mapped->data + file_offset, req->args[1]);
+        RESPOND(writer, "READ_FROM_LOGICAL_SPACE_OFFSET!SUCCESS!");
+    } else if(req->cmd == CMD_SHARE_FILE){
+        // the socket is listening before the reply goes out; the client
+        // connects once it has read it
+        if(s->mapped == NULL || share_offer(s, s->mapped->fd) != 0){
+            RESPOND(writer, "SHARE_FILE!ERROR!");
+            return 0;
+        }
+        RESPOND(writer, "SHARE_FILE!SUCCESS!");
+        writer_add_number(writer, s->mapped->size);
+    } else if(req->cmd == CMD_LOCATE_FILE_SECTION){
+        unsigned int file_offset = 0;
+
+        if(locate_section(s->mapped, req->args[0], req->args[1], req->args[2], &file_offset) != 0){
+            RESPOND(writer, "LOCATE_FILE_SECTION!ERROR!");
+            return 0;
+        }
+        RESPOND(writer, "LOCATE_FILE_SECTION!SUCCESS!");
+        writer_add_number(writer, file_offset);
+    } else if(req->cmd == CMD_LOCATE_LOGICAL_SPACE_OFFSET){
+        unsigned int file_offset = 0;
+
+        if(locate_logical(s->mapped, req->args[0], &file_offset) != 0 || (unsigned long)file_offset + req->args[1] > s->mapped->size){
+            RESPOND(writer, "LOCATE_LOGICAL_SPACE_OFFSET!ERROR!");
+            return 0;
+        }
+        RESPOND(writer, "LOCATE_LOGICAL_SPACE_OFFSET!SUCCESS!");
+        writer_add_number(writer, file_offset);
+    } else if(req->cmd == CMD_RING_CONNECT){
+        if(s->ring_map != NULL || (s->ring_map = ring_create(s->ring_name, req->args[0], &s->ring_map_size, &s->req_ring, &s->resp_ring)) == NULL){
+            RESPOND(writer, "RING_CONNECT!ERROR!");
+            return 0;
+        }
+        // last reply over the pipes; everything after it uses the rings
+        RESPOND(writer, "RING_CONNECT!SUCCESS!");
+        writer_add_number(writer, s->req_ring.size);
+        writer_flush(writer);
+        s->req_ring.alive_fd = s->resp_ring.alive_fd = s->fd_req;
+        // spinning only pays off when the client runs on another CPU
+        s->req_ring.spin = s->resp_ring.spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+        s->reader.ring = &s->req_ring;
+        s->writer.ring = &s->resp_ring;
+    } else if(req->cmd == CMD_READ_MULTI){
+        struct read_slice slices[READ_MULTI_MAX];
+
+        if(req->vec == NULL){
+            RESPOND(writer, "READ_MULTI!ERROR!");
+            return 0;
+        }
+        if(read_multi_prepare(s, req->vec, req->args[0], slices) != 0){
+            RESPOND(writer, "READ_MULTI!ERROR!");
+            return 0;
+        }
+        read_multi(slices, req->args[0]);
+        RESPOND(writer, "READ_MULTI!SUCCESS!");
+    } else if(req->cmd == CMD_OPEN_SESSION){
+        struct session *child = open_session();
+        if(child == NULL || session_watch(child, EPOLL_CTL_ADD) != 0){
+            RESPOND(writer, "OPEN_SESSION!ERROR!");
+            return 0;
+        }
+        RESPOND(writer, "OPEN_SESSION!SUCCESS!");
+        writer_add_number(writer, child->id);
+    } else if(req->cmd == CMD_EXIT){
+        writer_flush(writer);
+        return 1;
+    }
+    return 0;
+}
+
+static void* ring_session_run(void *arg){
+    struct session *s = (struct session*)arg;
+    struct request req;
+
+    while(read_request(&s->reader, &s->writer, &req)){
+        if(handle_request(s, &req)){
+            break;
+        }
+    }
+    close_session(s);
+    return NULL;
+}
+
+// Handles every request the session has buffered or can read without
+// blocking, then hands it back to epoll.
+static void session_run(struct session *s){
+    struct request req;
+
+    if(!s->resp_attached){
+        session_attach_resp(s);
+    }
+    for(;;){
+        if(parse_request(&s->reader, &req)){
+            if(handle_request(s, &req)){
+                close_session(s);
+                return;
+            }
+            if(s->reader.ring != NULL){
+                epoll_ctl(server.epfd, EPOLL_CTL_DEL, s->fd_req, NULL);
+                s->has_ring_thread = pthread_create(&s->ring_thread, NULL, ring_session_run, s) == 0;
+                if(!s->has_ring_thread){
+                    close_session(s);
+                }
+                return;
+            }
+            continue;
+        }
+        writer_flush(&s->writer);
+        if(s->writer.failed){
+            close_session(s);
+            return;
+        }
+        int n = reader_fill(&s->reader);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            session_watch(s, EPOLL_CTL_MOD);
+            return;
+        }
+        if(n <= 0){
+            close_session(s);
+            return;
+        }
+    }
+}
+
+static void* worker_run(void *arg){
+    struct epoll_event ev;
+
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+        int n = epoll_wait(server.epfd, &ev, 1, -1);
+        if(n <= 0 || ev.data.ptr == NULL){
+            continue;
+        }
+        if(is_share_point(ev.data.ptr)){
+            share_run((struct share_point*)ev.data.ptr);
+            continue;
+        }
+        session_run((struct session*)ev.data.ptr);
+    }
+    return NULL;
+}
+
+static int worker_count(void){
+    char *env = getenv("A3_WORKERS");
+    long n = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(n < 1){
+        n = 1;
+    }
+    return n > MAX_WORKERS ? MAX_WORKERS : n;
+}
+
+int main(){
+
+    if(mkfifo(RESP_PIPE, 0644) != 0){
+        perror("ERROR\ncannot create the response pipe\n");
+        return 1;
+    }
+
+    int fd_req = open(REQ_PIPE, O_RDONLY);
+
+    if(fd_req == -1){
+        perror("ERROR\ncannot open the request pipe");
+        return 1;
+    }
+
+    int fd_resp = open(RESP_PIPE, O_WRONLY);
+
+    if(fd_resp == -1){
+        perror("ERROR\ncannot open the response pipe");
+        return 1;
+    }
+
+    char* src = "BEGIN!";
+
+    write(fd_resp, src, strlen(src));
+    printf("SUCCESS\n");
+    fflush(stdout);
+
+    struct epoll_event ev;
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&server.lock, NULL);
+    for(int i = 0; i < MAX_SESSIONS; i++){
+        pthread_mutex_init(&server.shares[i].lock, NULL);
+        server.shares[i].sock = server.shares[i].fd = -1;
+    }
+    file_cache_init();
+    shm_opts_init();
+    server.epfd = epoll_create1(EPOLL_CLOEXEC);
+    server.stopfd = eventfd(0, EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.stopfd, &ev);
+
+    fcntl(fd_req, F_SETFL, fcntl(fd_req, F_GETFL) | O_NONBLOCK);
+    server.sessions[0] = session_new(0, fd_req, fd_resp);
+    session_watch(server.sessions[0], EPOLL_CTL_ADD);
+
+    server.nworkers = worker_count();
+    for(int i = 0; i < server.nworkers; i++){
+        pthread_create(&server.workers[i], NULL, worker_run, NULL);
+    }
+    for(int i = 0; i < server.nworkers; i++){
+        pthread_join(server.workers[i], NULL);
+    }
+
+    for(int i = MAX_SESSIONS - 1; i >= 0; i--){
+        pthread_mutex_lock(&server.lock);
+        struct session *s = server.sessions[i];
+        pthread_mutex_unlock(&server.lock);
+        if(s != NULL){
+            share_close(s);
+            session_destroy(s);
+        }
     }
+    close(server.stopfd);
+    close(server.epfd);
     return 0;
-}
\ No newline at end of file
+}
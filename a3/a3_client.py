@@ -0,0 +1,264 @@
+# Client side of the a3 protocol, shared by the *_test.py scripts: builds a3
+# into a temporary directory, starts it in the current directory (where it
+# creates its pipes and share sockets) and talks to its sessions over the
+# pipes or, after RING_CONNECT, over the shared-memory rings.
+import os, sys, struct, subprocess, signal, time, mmap, ctypes, json, base64
+
+import tester
+
+A3_PROG = "a3"
+REQ_PIPE = "REQ_PIPE_75664"
+RESP_PIPE = "RESP_PIPE_75664"
+SHM_NAME = "yTJuDV"
+RING_SHM = "yTJuDV_ring"
+SHARE_SOCK = "SHARE_SOCK_75664"
+VERSION = 75664
+TIME_LIMIT = 30
+
+# ring layout, see the comment on struct ring_ctl in a3.c
+RING_DATA_OFFSET = 4096
+REQ_TAIL, REQ_TAIL_WAITERS, REQ_HEAD, REQ_HEAD_WAITERS = 64, 68, 128, 132
+RESP_TAIL, RESP_TAIL_WAITERS, RESP_HEAD, RESP_HEAD_WAITERS = 192, 196, 256, 260
+U32 = 0xFFFFFFFF
+
+SYS_FUTEX = {"x86_64": 202, "aarch64": 98}.get(os.uname().machine)
+FUTEX_WAKE = 1
+
+class ProtocolError(Exception):
+    pass
+
+def loadData():
+    with open("a3_data.json") as a3_data:
+        return json.loads(base64.b64decode(a3_data.read()).decode("utf-8"))
+
+def testFiles():
+    return [os.path.join("test_root", f) for f in sorted(os.listdir("test_root"))]
+
+def compile(workDir):
+    prog = os.path.join(workDir, A3_PROG)
+    res = subprocess.run(["gcc", "-Wall", "%s.c" % A3_PROG, "-o", prog, "-lrt"],
+                         stderr=subprocess.PIPE, text=True)
+    if res.returncode != 0 or "warning" in res.stderr:
+        print(res.stderr)
+        sys.exit(1)
+    return prog
+
+def suffix(sid):
+    return "" if sid == 0 else ".%d" % sid
+
+def encode(*parts):
+    out = b""
+    for p in parts:
+        if isinstance(p, int):
+            out += struct.pack("I", p)
+        else:
+            out += (p.encode() if isinstance(p, str) else p) + b"!"
+    return out
+
+def watchdog(seconds=TIME_LIMIT):
+    # a hung server must fail the test, not hang it
+    def expired(_sig, _frame):
+        raise TimeoutError("no answer from a3 within %d seconds" % seconds)
+    signal.signal(signal.SIGALRM, expired)
+    signal.alarm(seconds)
+
+class PipeChannel:
+    def __init__(self, reqPath, respPath):
+        self.req = open(reqPath, "wb", buffering=0)
+        deadline = time.time() + 5
+        while not os.path.exists(respPath) and time.time() < deadline:
+            time.sleep(0.01)
+        self.resp = open(respPath, "rb", buffering=0)
+
+    def write(self, data):
+        self.req.write(data)
+
+    def read(self, n):
+        out = b""
+        while len(out) < n:
+            chunk = self.resp.read(n - len(out))
+            if not chunk:
+                raise ProtocolError("response pipe closed")
+            out += chunk
+        return out
+
+    def close(self):
+        self.req.close()
+        self.resp.close()
+
+class RingChannel:
+    def __init__(self, sid, size):
+        fd = os.open("/dev/shm/%s%s" % (RING_SHM, suffix(sid)), os.O_RDWR)
+        self.map = mmap.mmap(fd, RING_DATA_OFFSET + 2 * size)
+        os.close(fd)
+        self.size = size
+        self.pending = b""
+        self.anchor = ctypes.c_char.from_buffer(self.map)
+        self.base = ctypes.addressof(self.anchor)
+        self.libc = ctypes.CDLL(None, use_errno=True)
+
+    def get(self, off):
+        return struct.unpack_from("I", self.map, off)[0]
+
+    def set(self, off, value):
+        struct.pack_into("I", self.map, off, value & U32)
+
+    def wake(self, off, waitersOff):
+        if SYS_FUTEX is not None and self.get(waitersOff):
+            self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(self.base + off), FUTEX_WAKE, 1, None, None, 0)
+
+    def copyIn(self, dataOff, pos, data):
+        first = min(self.size - pos, len(data))
+        self.map[dataOff + pos:dataOff + pos + first] = data[:first]
+        self.map[dataOff:dataOff + len(data) - first] = data[first:]
+
+    def copyOut(self, dataOff, pos, n):
+        first = min(self.size - pos, n)
+        return self.map[dataOff + pos:dataOff + pos + first] + self.map[dataOff:dataOff + n - first]
+
+    # Moves whatever the server has answered into 'pending', which also
+    # frees the response ring for a server blocked on it.
+    def pump(self):
+        head = self.get(RESP_HEAD)
+        n = (self.get(RESP_TAIL) - head) & U32
+        if n == 0:
+            time.sleep(0.0002)
+            return
+        self.pending += self.copyOut(RING_DATA_OFFSET + self.size, head & (self.size - 1), n)
+        self.set(RESP_HEAD, head + n)
+        self.wake(RESP_HEAD, RESP_HEAD_WAITERS)
+
+    def write(self, data):
+        while data:
+            tail = self.get(REQ_TAIL)
+            free = self.size - ((tail - self.get(REQ_HEAD)) & U32)
+            if free == 0:
+                self.pump()
+                continue
+            n = min(free, len(data))
+            self.copyIn(RING_DATA_OFFSET, tail & (self.size - 1), data[:n])
+            self.set(REQ_TAIL, tail + n)
+            self.wake(REQ_TAIL, REQ_TAIL_WAITERS)
+            data = data[n:]
+
+    def read(self, n):
+        while len(self.pending) < n:
+            self.pump()
+        out, self.pending = self.pending[:n], self.pending[n:]
+        return out
+
+    def close(self):
+        del self.anchor
+        self.map.close()
+
+class Session:
+    def __init__(self, sid, channel):
+        self.sid = sid
+        self.channel = channel
+        self.pipes = channel
+        self.shm = None
+
+    def send(self, *parts):
+        self.channel.write(encode(*parts))
+
+    def readString(self):
+        out = b""
+        while True:
+            c = self.channel.read(1)
+            if c == b"!":
+                return out.decode()
+            out += c
+            if len(out) > 250:
+                raise ProtocolError("unterminated string %r" % out)
+
+    def readNumber(self):
+        return struct.unpack("I", self.channel.read(4))[0]
+
+    # Reads the echoed command name and returns the status string.
+    def reply(self, name):
+        echoed = self.readString()
+        if echoed != name:
+            raise ProtocolError("expected %s, got %s" % (name, echoed))
+        return self.readString()
+
+    def call(self, name, *args):
+        self.send(name, *args)
+        return self.reply(name)
+
+    def ping(self):
+        self.send("PING")
+        if self.readString() != "PING" or self.readNumber() != VERSION or self.readString() != "PONG":
+            raise ProtocolError("bad PING reply")
+
+    def createShm(self, size):
+        if self.call("CREATE_SHM", size) != "SUCCESS":
+            raise ProtocolError("CREATE_SHM failed")
+        fd = os.open("/dev/shm/%s%s" % (SHM_NAME, suffix(self.sid)), os.O_RDONLY)
+        self.shm = mmap.mmap(fd, size, prot=mmap.PROT_READ)
+        os.close(fd)
+        return self.shm
+
+    def mapFile(self, path):
+        if self.call("MAP_FILE", path) != "SUCCESS":
+            raise ProtocolError("MAP_FILE %s failed" % path)
+
+    def ringConnect(self, size):
+        if self.call("RING_CONNECT", size) != "SUCCESS":
+            raise ProtocolError("RING_CONNECT failed")
+        self.channel = RingChannel(self.sid, self.readNumber())
+        return self.channel
+
+    def close(self):
+        if self.shm is not None:
+            self.shm.close()
+        if self.channel is not self.pipes:
+            self.channel.close()
+        self.pipes.close()
+
+class Server:
+    def __init__(self, prog, env=None):
+        for p in (REQ_PIPE, RESP_PIPE):
+            if os.path.exists(p):
+                os.remove(p)
+        os.mkfifo(REQ_PIPE, 0o644)
+        self.proc = subprocess.Popen([prog], env=dict(os.environ, **(env or {})),
+                                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.main = Session(0, PipeChannel(REQ_PIPE, RESP_PIPE))
+        if self.main.readString() != "BEGIN":
+            raise ProtocolError("no BEGIN from a3")
+
+    def openSession(self):
+        if self.main.call("OPEN_SESSION") != "SUCCESS":
+            raise ProtocolError("OPEN_SESSION failed")
+        sid = self.main.readNumber()
+        s = Session(sid, PipeChannel(REQ_PIPE + suffix(sid), RESP_PIPE + suffix(sid)))
+        if s.readString() != "BEGIN":
+            raise ProtocolError("no BEGIN on session %d" % sid)
+        return s
+
+    def sessionGone(self, sid, timeout=5):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            if not os.path.exists(REQ_PIPE + suffix(sid)):
+                return True
+            time.sleep(0.02)
+        return False
+
+    def stop(self):
+        try:
+            self.main.send("EXIT")
+            self.proc.wait(timeout=5)
+        except Exception:
+            self.proc.kill()
+            self.proc.wait()
+        self.main.close()
+        for p in (REQ_PIPE, RESP_PIPE):
+            if os.path.exists(p):
+                os.remove(p)
+        return self.proc.returncode
+
+def report(ok, name, details=None):
+    print("%s %s" % ("ok  " if ok else "FAIL", name))
+    if not ok and details:
+        print("\t%s" % details)
+    return 0 if ok else 1
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+# Checks READ_MULTI. A batch mixing file offsets, section offsets and
+# logical offsets must put every slice at its shm destination. A batch with
+# any record out of range must be rejected as a whole, leaving shm as it
+# was. A count over READ_MULTI_MAX must be skipped with an ERROR reply while
+# the session keeps working, over the pipes, on an opened session and over
+# the rings.
+import sys, random, tempfile, shutil
+
+import tester
+import a3_client as a3
+
+SHM_SIZE = 1024 * 1024
+READ_MULTI_MAX = 1024
+OFFSET, SECTION, LOGICAL = 0, 1, 2
+
+def readMulti(session, records):
+    return session.call("READ_MULTI", len(records), *[v for r in records for v in r])
+
+def layout(data, path):
+    align = int(data["logical_space_section_alignment"])
+    sections = tester.getSectionsTable(data, path)
+    logical = []
+    start = 0
+    for _name, _type, offset, size in sections:
+        logical.append(start)
+        start += (size + align - 1) // align * align
+    return sections, logical, start
+
+# A batch of every kind of record, packed one after another in shm from a
+# random start. Returns the records and the (shm offset, bytes) they give.
+def mixedBatch(rng, content, sections, logical):
+    records = []
+    expected = []
+    dst = rng.randint(0, 4096)
+    def add(record, want):
+        nonlocal dst
+        records.append(record + (len(want), dst))
+        expected.append((dst, want))
+        dst += len(want)
+    for i, (_name, _type, offset, size) in enumerate(sections):
+        ro = rng.randint(0, size - 1)
+        ln = rng.randint(1, min(size - ro, 8192))
+        add((SECTION, i + 1, ro), content[offset + ro:offset + ro + ln])
+        ro = rng.randint(0, size - 1)
+        ln = rng.randint(1, min(size - ro, 8192))
+        add((LOGICAL, logical[i] + ro, 0), content[offset + ro:offset + ro + ln])
+        off = rng.randint(0, len(content) - 1)
+        ln = rng.randint(1, min(len(content) - off, 8192))
+        add((OFFSET, off, 0), content[off:off + ln])
+    rng.shuffle(records)
+    return records, expected
+
+def checkBatches(session, data, rng):
+    for path in a3.testFiles():
+        content = open(path, "rb").read()
+        sections, logical, logicalEnd = layout(data, path)
+        session.mapFile(path)
+        records, expected = mixedBatch(rng, content, sections, logical)
+        if readMulti(session, records) != "SUCCESS":
+            return "%s: mixed batch of %d records failed" % (path, len(records))
+        for dst, want in expected:
+            if session.shm[dst:dst + len(want)] != want:
+                return "%s: wrong bytes at shm offset %d" % (path, dst)
+        if readMulti(session, []) != "SUCCESS":
+            return "%s: empty batch failed" % path
+
+        # a valid record first, so a partial copy would show in shm
+        before = session.shm[:]
+        first = (OFFSET, 0, 0, len(content), SHM_SIZE - len(content))
+        _name, _type, _offset, size = sections[-1]
+        bad = [
+            ("section 0", (SECTION, 0, 0, 1, 0)),
+            ("section past the last", (SECTION, len(sections) + 1, 0, 1, 0)),
+            ("slice past the section end", (SECTION, len(sections), size - 1, 2, 0)),
+            ("file offset past the end", (OFFSET, len(content), 0, 1, 0)),
+            ("slice past the file end", (OFFSET, 0, 0, len(content) + 1, 0)),
+            ("logical offset past the end", (LOGICAL, logicalEnd, 0, 1, 0)),
+            ("destination past shm", (OFFSET, 0, 0, 2, SHM_SIZE - 1)),
+            ("destination wrapping 32 bits", (OFFSET, 0, 0, 16, a3.U32 - 7)),
+            ("unknown mode", (3, 0, 0, 1, 0)),
+        ]
+        for name, record in bad:
+            if readMulti(session, [first, record]) != "ERROR":
+                return "%s: %s accepted" % (path, name)
+            if session.shm[:] != before:
+                return "%s: %s changed shm" % (path, name)
+    return None
+
+# Sends an oversized batch in chunks, so the server skips records across
+# several reads, then checks the session still answers. A session dropped
+# by the server shows up as a closed pipe here.
+def checkOversized(session, count, path):
+    payload = a3.encode("READ_MULTI", count) + b"\1\0\0\0" * (count * 5)
+    try:
+        for i in range(0, len(payload), 7000):
+            session.channel.write(payload[i:i + 7000])
+        if session.reply("READ_MULTI") != "ERROR":
+            return "%d records not rejected" % count
+        session.ping()
+    except (a3.ProtocolError, OSError) as e:
+        return "session ended: %s" % e
+    content = open(path, "rb").read()
+    if readMulti(session, [(OFFSET, 0, 0, 64, 0)]) != "SUCCESS" or session.shm[:64] != content[:64]:
+        return "READ_MULTI after %d records failed" % count
+    return None
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a3_read_multi_test_")
+    failed = 0
+    a3.watchdog()
+    try:
+        prog = a3.compile(workDir)
+        data = a3.loadData()
+        path = a3.testFiles()[0]
+        server = a3.Server(prog)
+        try:
+            s0 = server.main
+            failed += a3.report(readMulti(s0, [(OFFSET, 0, 0, 1, 0)]) == "ERROR",
+                                "READ_MULTI without shm or a mapped file is rejected")
+            s0.createShm(SHM_SIZE)
+            error = checkBatches(s0, data, random.Random(75664))
+            failed += a3.report(error is None, "mixed batches and out-of-range records", error)
+
+            other = server.openSession()
+            other.createShm(SHM_SIZE)
+            other.mapFile(path)
+            ring = server.openSession()
+            ring.createShm(SHM_SIZE)
+            ring.mapFile(path)
+            ring.ringConnect(4096)
+            s0.mapFile(path)
+            for name, session in (("session 0", s0), ("an opened session", other), ("a ring session", ring)):
+                for count in (READ_MULTI_MAX + 1, 5000):
+                    error = checkOversized(session, count, path)
+                    failed += a3.report(error is None, "%d records skipped on %s" % (count, name), error)
+                    if error is not None:
+                        # the server may be gone with it
+                        sys.exit(1)
+            error = checkBatches(ring, data, random.Random(3072))
+            failed += a3.report(error is None, "mixed batches over the rings", error)
+            other.close()
+            ring.close()
+        finally:
+            failed += a3.report(server.stop() == 0, "server exits cleanly")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+# Checks the shared-memory ring transport (RING_CONNECT). The same requests
+# must get the same replies and shm contents over the rings as over the
+# pipes, also when requests and replies wrap around the end of a small ring
+# and when many are in flight at once. A client that writes ring indices
+# overrunning the ring must lose its session (EPROTO on the server side)
+# without taking the server down.
+import sys, random, tempfile, shutil
+
+import tester
+import a3_client as a3
+
+RING_SIZE = 4096
+SHM_SIZE = 64 * 1024
+READS_PER_FILE = 30
+
+def requests(rng, data):
+    align = int(data["logical_space_section_alignment"])
+    reqs = [("PING",)]
+    for path in a3.testFiles():
+        content = open(path, "rb").read()
+        sections = tester.getSectionsTable(data, path)
+        logical = []
+        start = 0
+        for _name, _type, offset, size in sections:
+            logical.append((start, offset, size))
+            start += (size + align - 1) // align * align
+        reqs.append(("MAP_FILE", path))
+        for _i in range(READS_PER_FILE):
+            off = rng.randint(0, len(content) - 1)
+            reqs.append(("READ_FROM_FILE_OFFSET", off, rng.randint(1, min(len(content) - off, SHM_SIZE))))
+            sect = rng.randint(1, len(sections))
+            size = sections[sect - 1][3]
+            ro = rng.randint(0, size - 1)
+            reqs.append(("READ_FROM_FILE_SECTION", sect, ro, rng.randint(1, size - ro)))
+            lstart, _offset, size = logical[rng.randint(0, len(logical) - 1)]
+            ro = rng.randint(0, size - 1)
+            reqs.append(("READ_FROM_LOGICAL_SPACE_OFFSET", lstart + ro, rng.randint(1, size - ro)))
+        reqs.append(("READ_FROM_FILE_SECTION", len(sections) + 1, 0, 10))
+        reqs.append(("READ_FROM_FILE_OFFSET", len(content), 1))
+        # a long path makes the request itself cross the ring end now and then
+        reqs.append(("MAP_FILE", "test_root/" + "x" * 200))
+        reqs.append(("MAP_FILE", path))
+    return reqs
+
+# Replies plus, after every successful read, the bytes it put in shm.
+def transcript(session, reqs):
+    out = []
+    for req in reqs:
+        session.send(*req)
+        if req[0] == "PING":
+            out.append((session.readString(), session.readNumber(), session.readString()))
+            continue
+        status = session.reply(req[0])
+        entry = (req[0], status)
+        if req[0].startswith("READ_") and status == "SUCCESS":
+            entry += (session.shm[:req[-1]],)
+        out.append(entry)
+    return out
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a3_ring_test_")
+    failed = 0
+    a3.watchdog()
+    try:
+        prog = a3.compile(workDir)
+        data = a3.loadData()
+        reqs = requests(random.Random(75664), data)
+        server = a3.Server(prog)
+        try:
+            viaPipes = server.openSession()
+            viaPipes.createShm(SHM_SIZE)
+            expected = transcript(viaPipes, reqs)
+
+            viaRing = server.openSession()
+            viaRing.createShm(SHM_SIZE)
+            ring = viaRing.ringConnect(RING_SIZE)
+            failed += a3.report(ring.size == RING_SIZE, "RING_CONNECT gives the requested size", ring.size)
+            got = transcript(viaRing, reqs)
+            bad = [i for i in range(len(reqs)) if i >= len(got) or got[i] != expected[i]]
+            failed += a3.report(len(bad) == 0, "ring replies and shm contents match the pipes",
+                                "%d differ, first %s" % (len(bad), reqs[bad[0]] if bad else None))
+
+            # many requests in flight: the request ring fills up while the
+            # server waits for room in the response ring
+            burst = [("PING",), ("MAP_FILE", "test_root/" + "y" * 200)] * 1000
+            viaRing.send(*[part for req in burst for part in req])
+            ok = True
+            for req in burst:
+                if req[0] == "PING":
+                    ok = ok and (viaRing.readString(), viaRing.readNumber(), viaRing.readString()) == ("PING", a3.VERSION, "PONG")
+                else:
+                    ok = ok and viaRing.reply("MAP_FILE") == "ERROR"
+            failed += a3.report(ok, "pipelined burst over a full ring")
+            wraps = ring.get(a3.REQ_TAIL) // RING_SIZE, ring.get(a3.RESP_TAIL) // RING_SIZE
+            failed += a3.report(min(wraps) >= 5, "both rings wrapped around at least 5 times", "wraps %s" % (wraps,))
+
+            # a tail far ahead of head: the server must not copy stale data
+            ring.set(a3.REQ_TAIL, ring.get(a3.REQ_HEAD) + 100 * RING_SIZE)
+            failed += a3.report(server.sessionGone(viaRing.sid), "request tail overrunning the ring ends the session")
+            viaRing.close()
+
+            # a head claiming more free space than the ring has
+            bad = server.openSession()
+            ring = bad.ringConnect(RING_SIZE)
+            bad.ping()
+            ring.set(a3.RESP_HEAD, ring.get(a3.RESP_HEAD) + 5 * RING_SIZE)
+            bad.send("PING")
+            failed += a3.report(server.sessionGone(bad.sid), "response head overrunning the ring ends the session")
+            bad.close()
+
+            try:
+                viaPipes.ping()
+                server.main.ping()
+                answered = True
+            except a3.ProtocolError as e:
+                answered = e
+            failed += a3.report(answered is True, "other sessions still answer", answered)
+        finally:
+            failed += a3.report(server.stop() == 0, "server exits cleanly")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+# Checks that a3 serves several sessions at once (OPEN_SESSION, epoll
+# worker pool). Each session gets its own shm and mapped file. MAP_FILE and
+# READ_* requests are interleaved across the sessions, several in flight per
+# session, and every read must land in that session's shm only. A client
+# that stops reading, or never opens its response pipe, must lose its
+# session without stalling the others, even with a single worker.
+import os, sys, random, tempfile, shutil
+
+import tester
+import a3_client as a3
+
+SESSIONS = 8
+ROUNDS = 200
+IN_FLIGHT = 4
+SHM_SIZE = 256 * 1024
+
+class Client:
+    def __init__(self, session, rng, data, files):
+        self.session = session
+        self.rng = rng
+        self.data = data
+        self.files = files
+        self.content = None
+        self.sections = None
+
+    def mapRandomFile(self):
+        path = self.files[self.rng.randint(0, len(self.files) - 1)]
+        self.session.send("MAP_FILE", path)
+        self.content = open(path, "rb").read()
+        self.sections = tester.getSectionsTable(self.data, path)
+        return ("MAP_FILE", None)
+
+    # Sends one random read and returns what the reply should be and which
+    # bytes should then be at the start of shm.
+    def sendRead(self):
+        if self.rng.random() < 0.5:
+            off = self.rng.randint(0, len(self.content) - 1)
+            ln = self.rng.randint(1, min(len(self.content) - off, SHM_SIZE))
+            self.session.send("READ_FROM_FILE_OFFSET", off, ln)
+            return ("READ_FROM_FILE_OFFSET", self.content[off:off + ln])
+        sect = self.rng.randint(1, len(self.sections))
+        _name, _type, offset, size = self.sections[sect - 1]
+        ro = self.rng.randint(0, size - 1)
+        ln = self.rng.randint(1, size - ro)
+        self.session.send("READ_FROM_FILE_SECTION", sect, ro, ln)
+        return ("READ_FROM_FILE_SECTION", self.content[offset + ro:offset + ro + ln])
+
+def interleave(server, data, workers):
+    rng = random.Random(workers)
+    files = a3.testFiles()
+    clients = []
+    for k in range(SESSIONS):
+        s = server.openSession()
+        s.createShm(SHM_SIZE)
+        clients.append(Client(s, random.Random(k), data, files))
+    ids = sorted(c.session.sid for c in clients)
+    if len(set(ids)) != SESSIONS or 0 in ids:
+        return "session ids %s" % ids
+    for c in clients:
+        c.mapRandomFile()
+        if c.session.reply("MAP_FILE") != "SUCCESS":
+            return "MAP_FILE failed on session %d" % c.session.sid
+    for rnd in range(ROUNDS):
+        order = clients[:]
+        rng.shuffle(order)
+        pending = {}
+        # several requests queued on every session before any reply is read;
+        # only the last read of each batch decides what shm holds
+        for c in order:
+            pending[c] = [c.mapRandomFile() if rng.random() < 0.1 else c.sendRead() for _i in range(IN_FLIGHT)]
+        rng.shuffle(order)
+        for c in order:
+            last = None
+            for name, expected in pending[c]:
+                status = c.session.reply(name)
+                if status != "SUCCESS":
+                    return "%s failed on session %d in round %d" % (name, c.session.sid, rnd)
+                if expected is not None:
+                    last = expected
+            if last is not None and c.session.shm[:len(last)] != last:
+                return "session %d has the wrong bytes in shm after round %d" % (c.session.sid, rnd)
+    for c in clients[::2]:
+        c.session.send("EXIT")
+        c.session.close()
+    for c in clients[::2]:
+        if not server.sessionGone(c.session.sid):
+            return "session %d still there after EXIT" % c.session.sid
+    for c in clients[1::2]:
+        c.session.ping()
+        c.session.close()
+    return None
+
+# Fills the request pipe with PINGs whose replies nobody reads. A server
+# stuck on the response pipe stops reading, so the writes here must not
+# block either.
+def flood(req):
+    os.set_blocking(req.fileno(), False)
+    try:
+        for _i in range(40):
+            req.write(b"PING!" * 5000)
+    except (BrokenPipeError, BlockingIOError):
+        pass
+
+def stalledClients(server):
+    # reads one reply, then closes its end of the response pipe
+    s = server.openSession()
+    s.ping()
+    s.pipes.resp.close()
+    flood(s.pipes.req)
+    if not server.sessionGone(s.sid):
+        # a stuck worker would not get to the next OPEN_SESSION either
+        return ["session whose client closed its response pipe was kept"]
+    s.pipes.req.close()
+    # never opens the response pipe at all
+    if server.main.call("OPEN_SESSION") != "SUCCESS":
+        return ["OPEN_SESSION failed"]
+    sid = server.main.readNumber()
+    with open(a3.REQ_PIPE + a3.suffix(sid), "wb", buffering=0) as req:
+        flood(req)
+    if not server.sessionGone(sid):
+        return ["session whose client never opened its response pipe was kept"]
+    server.main.ping()
+    return []
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a3_session_test_")
+    failed = 0
+    a3.watchdog(120)
+    try:
+        prog = a3.compile(workDir)
+        data = a3.loadData()
+        for workers in (1, 4):
+            server = a3.Server(prog, {"A3_WORKERS": str(workers)})
+            try:
+                error = interleave(server, data, workers)
+                failed += a3.report(error is None, "%d sessions interleaved, %d worker(s)" % (SESSIONS, workers), error)
+                errors = stalledClients(server)
+                failed += a3.report(len(errors) == 0, "stalled clients are dropped, %d worker(s)" % workers, "; ".join(errors))
+            finally:
+                failed += a3.report(server.stop() == 0, "server exits cleanly")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# Checks the zero-copy path. The descriptor SHARE_FILE passes over the
+# session's share socket (SCM_RIGHTS) must map to the same bytes as the
+# file, read-only. The offsets LOCATE_FILE_SECTION and
+# LOCATE_LOGICAL_SPACE_OFFSET answer must point at the bytes
+# READ_FROM_FILE_SECTION and READ_FROM_LOGICAL_SPACE_OFFSET copy for the
+# same arguments, and both must reject the same out-of-range requests.
+import os, sys, random, socket, mmap, tempfile, shutil
+
+import tester
+import a3_client as a3
+
+SHM_SIZE = 256 * 1024
+LOCATES_PER_FILE = 50
+
+def receiveFd(sid):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.settimeout(5)
+    try:
+        sock.connect(a3.SHARE_SOCK + a3.suffix(sid))
+        _msg, fds, _flags, _addr = socket.recv_fds(sock, 1, 1)
+    finally:
+        sock.close()
+    return fds[0] if fds else None
+
+# LOCATE_* and the matching READ_FROM_* for one set of arguments. Returns
+# the located file offset (None on ERROR) and the copied bytes (None on
+# ERROR).
+def locateAndRead(session, kind, *args):
+    located = None
+    if session.call("LOCATE_" + kind, *args) == "SUCCESS":
+        located = session.readNumber()
+    copied = None
+    if session.call("READ_FROM_" + kind, *args) == "SUCCESS":
+        copied = session.shm[:args[-1]]
+    return located, copied
+
+def checkFile(session, data, rng, path):
+    content = open(path, "rb").read()
+    session.mapFile(path)
+    if session.call("SHARE_FILE") != "SUCCESS":
+        return "SHARE_FILE failed", None
+    size = session.readNumber()
+    fd = receiveFd(session.sid)
+    if fd is None:
+        return "no descriptor received", None
+    try:
+        if size != len(content) or os.fstat(fd).st_size != size:
+            return "size %d, file has %d" % (size, len(content)), None
+        try:
+            os.write(fd, b"x")
+            return "the shared descriptor is writable", None
+        except OSError:
+            pass
+        view = mmap.mmap(fd, size, prot=mmap.PROT_READ)
+    finally:
+        os.close(fd)
+    if view[:] != content:
+        return "mapped bytes differ from the file", view
+
+    align = int(data["logical_space_section_alignment"])
+    sections = tester.getSectionsTable(data, path)
+    logical = []
+    start = 0
+    for _name, _type, offset, sectSize in sections:
+        logical.append((start, offset, sectSize))
+        start += (sectSize + align - 1) // align * align
+    cases = []
+    for _i in range(LOCATES_PER_FILE):
+        sect = rng.randint(1, len(sections))
+        sectSize = sections[sect - 1][3]
+        ro = rng.randint(0, sectSize - 1)
+        cases.append(("FILE_SECTION", sect, ro, rng.randint(1, sectSize - ro)))
+        lstart, _offset, sectSize = logical[rng.randint(0, len(logical) - 1)]
+        ro = rng.randint(0, sectSize - 1)
+        cases.append(("LOGICAL_SPACE_OFFSET", lstart + ro, rng.randint(1, sectSize - ro)))
+    lastSize = sections[-1][3]
+    bad = [
+        ("FILE_SECTION", 0, 0, 1),
+        ("FILE_SECTION", len(sections) + 1, 0, 1),
+        ("FILE_SECTION", len(sections), lastSize, 1),
+        ("FILE_SECTION", len(sections), 0, lastSize + 1),
+        ("LOGICAL_SPACE_OFFSET", start, 1),
+        ("LOGICAL_SPACE_OFFSET", 0, len(content) + 1),
+    ]
+    for case in cases + bad:
+        located, copied = locateAndRead(session, *case)
+        if (located is None) != (case in bad) or (copied is None) != (case in bad):
+            return "%s: LOCATE %s, READ %s" % (case, located is not None, copied is not None), view
+        if located is not None and view[located:located + case[-1]] != copied:
+            return "%s: located bytes differ from the copied ones" % (case,), view
+    return None, view
+
+def main():
+    workDir = tempfile.mkdtemp(prefix="a3_share_test_")
+    failed = 0
+    a3.watchdog()
+    try:
+        prog = a3.compile(workDir)
+        data = a3.loadData()
+        server = a3.Server(prog)
+        try:
+            other = server.openSession()
+            for name, session in (("session 0", server.main), ("an opened session", other)):
+                failed += a3.report(session.call("SHARE_FILE") == "ERROR", "SHARE_FILE before MAP_FILE fails on %s" % name)
+                failed += a3.report(session.call("LOCATE_FILE_SECTION", 1, 0, 1) == "ERROR"
+                                    and session.call("LOCATE_LOGICAL_SPACE_OFFSET", 0, 1) == "ERROR",
+                                    "LOCATE_* before MAP_FILE fails on %s" % name)
+                session.createShm(SHM_SIZE)
+                rng = random.Random(session.sid)
+                views = []
+                for path in a3.testFiles():
+                    error, view = checkFile(session, data, rng, path)
+                    failed += a3.report(error is None, "%s shared and located on %s" % (path, name), error)
+                    if view is not None:
+                        views.append((path, view))
+                # the client's mappings outlive the server switching files
+                stale = [path for path, view in views if view[:] != open(path, "rb").read()]
+                failed += a3.report(len(stale) == 0, "shared mappings stay valid after MAP_FILE", stale)
+                for _path, view in views:
+                    view.close()
+                # one descriptor per SHARE_FILE: a second connect gets none
+                failed += a3.report(receiveFd(session.sid) is None, "a descriptor is handed out only once on %s" % name)
+            other.send("EXIT")
+            other.close()
+            failed += a3.report(server.sessionGone(other.sid) and not os.path.exists(a3.SHARE_SOCK + a3.suffix(other.sid)),
+                                "the share socket goes with its session")
+        finally:
+            failed += a3.report(server.stop() == 0, "server exits cleanly")
+            failed += a3.report(not os.path.exists(a3.SHARE_SOCK), "the share socket is removed on exit")
+    finally:
+        shutil.rmtree(workDir)
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()